@@ -39,24 +39,356 @@
   * like this.  
   */
 
+/*CONFIG_OVERRIDE lets a build pick the storage switches itself with -D flags
+ * (the host benchmarks do) instead of taking the ones below.
+ */
+#ifndef CONFIG_OVERRIDE
 //Uncomment the following line to use SPI memory for pix array.
 #define USE_SPI_MEM //Comment out this line to use Arduino memory for pix array.
 
+/*Uncomment to store pixels as 3 bytes (green, red, blue, the order the strip
+ * wants them) rather than a 4 byte COLOR.  That's a quarter less memory and 
+ * SPI traffic, and the display loop sends the bytes as they are.  388 packed
+ * pixels fit in arduino memory; 388 COLORs do not.
+ */
+//#define USE_PACKED_PIX
+#endif
+
+/*Uncomment to use the branch free (SWAR) version of the rain step, which
+ * works on all three channels of a pixel at once.  It makes exactly the same
+ * rain as the plain loop; which one is faster is for the bench to say.
+ */
+//#define USE_SWAR_WALK
+
+/*With BRITE_TABLE 1 every byte on its way to the strip goes through a 256
+ * byte table in arduino memory, so brightness (MAX_BRITE) and gamma cost a
+ * lookup per byte rather than a multiply per pixel, and the pix array itself
+ * is never touched.  See LitePixel::setBrightness.
+ * BRITE_GAMMA 1 puts the values through the gamma curve in gamma.h as well.
+ * At full brightness without gamma the table would send every byte as it is,
+ * so unless you ask for it (to call lite.setBrightness() as you go) it's only
+ * built when CONFIG_MAX_BRITE or BRITE_GAMMA need it, and otherwise the 256
+ * bytes are left for everything else.
+ */
+#ifndef BRITE_GAMMA
+#define BRITE_GAMMA 0
+#endif
+#ifndef CONFIG_MAX_BRITE
+#define CONFIG_MAX_BRITE 255
+#endif
+#ifndef BRITE_TABLE
+#if CONFIG_MAX_BRITE < 255 || BRITE_GAMMA
+#define BRITE_TABLE 1
+#else
+#define BRITE_TABLE 0
+#endif
+#endif
+
+/*For very long strips: each frame steps only every WALK_STRIDE'th pixel,
+ * starting one pixel further along each frame, so every pixel still gets its
+ * step once every WALK_STRIDE frames.  The walk costs a WALK_STRIDE'th as much
+ * a frame, so frames come WALK_STRIDE times as often for the same rain.  1
+ * steps every pixel every frame.
+ */
+#ifndef WALK_STRIDE
+#define WALK_STRIDE 1
+#endif
+
+/*SPI RAM (USE_SPI_MEM) is SPI_BANKS chips of SPI_BANK_BYTES each, one after
+ * the other in one address space (see spi_mem.h).  32768 is a 23K256; 131072
+ * is a 23LC1024, which takes 24 bit addresses.  Each chip has its own chip
+ * select pin, in SPI_BANK_PINS order.  Pin 7 is on the LED port, so a 4th
+ * bank leaves one fewer pin for LED lanes.
+ */
+#ifndef SPI_BANKS
+#define SPI_BANKS 1
+#endif
+#ifndef SPI_BANK_BYTES
+#define SPI_BANK_BYTES 32768L
+#endif
+#ifndef SPI_BANK_PINS
+#define SPI_BANK_PINS { 10, 9, 8, 7 }
+#endif
+
+/*Sending a frame used to keep interrupts off from the first pixel to the
+ * last, 14ms at 388 LEDs: millis() lost ticks and Serial lost bytes.  Now the
+ * display lets interrupts in every EMIT_GROUP_PIX pixels (36us a pixel, so
+ * 144us at 4).  Serial holds 2 bytes in hardware, 170us at 115200 baud, so
+ * keep the group shorter than that at the fastest baud rate you use.  0 keeps
+ * interrupts off for the whole frame as before.  See LitePixel::letInterruptsIn.
+ */
+#ifndef EMIT_GROUP_PIX
+#define EMIT_GROUP_PIX 4
+#endif
+
+/*The longest the LED wire may sit low in the middle of a frame.  Any longer
+ * and the strip takes it as the end of the frame: it shows what it has and the
+ * rest starts over from the first LED.  Parts differ.  Josh measured his
+ * latching after as little as 6us, and the WS2812 datasheet only promises not
+ * to before 50us, which is what we hold to.  Every gap the display leaves,
+ * between bits, bytes and pixels, and with any interrupts let in, is checked
+ * against LATCH_US when the sketch compiles (see litepixel.h).  On a strip
+ * that latches early, lower it: builds that can't keep to it then won't
+ * build, which beats a strip that flickers.
+ */
+#ifndef LATCH_US
+#define LATCH_US 50
+#endif
+
+/*The longest the interrupts let in between pixels keep the wire low: timer0
+ * (millis), Serial receive and Serial send, back to back.  20 is an estimate,
+ * about 5us each with entry and exit on a 16MHz part, NOT a measurement.  Time
+ * the window on your board (a scope on the LED pin, or micros() either side of
+ * letInterruptsIn with something arriving on Serial) and put its worst here.
+ */
+#ifndef ISR_BUDGET_US
+#define ISR_BUDGET_US 20
+#endif
+
+/*Uncomment to keep two frames of pixels, one on show and one being worked on
+ * (see PixelArray).  Twice the memory, so it's for SPI RAM or short strips.
+ */
+//#define USE_DOUBLE_BUFFER
+#ifdef USE_DOUBLE_BUFFER
+#define PIX_FRAMES 2
+#else
+#define PIX_FRAMES 1
+#endif
+
+/*Uncomment to work out each pixel just before it is sent rather than walking
+ * the whole strip and then sending it (see stream.h).  Same rain, one sweep of
+ * the pix array a frame instead of two.  Single lane only.  EMIT_GROUP_PIX
+ * doesn't apply: interrupts stay off from the first pixel to the last, 13ms
+ * at 388 LEDs, so millis() loses ticks and Serial loses what it receives
+ * every frame.
+ */
+//#define STREAM_RENDER
+
+/*Uncomment to have the hot paths (the rain walk, span reads and writes,
+ * sendWire and display_pix) time themselves and count SPI bytes and changed
+ * pixels.  Every TELEMETRY_FRAMES frames a summary goes out over Serial as a
+ * 61 byte binary record, with the frames the scheduler missed; host/teledump
+ * decodes it.  Commented out, none of it is built.  See telemetry.h.
+ */
+//#define USE_TELEMETRY
+#ifndef TELEMETRY_FRAMES
+#define TELEMETRY_FRAMES 32
+#endif
+
+/*Uncomment to send what the rain does to each pixel over Serial, frame by
+ * frame, for host/capdump to turn back into frames (see capture.h).  It shares
+ * Serial with nothing, so not with USE_TELEMETRY, and not with STREAM_RENDER,
+ * which has no time between pixels for it.  388 pixels' changes are about 420
+ * bytes a frame, more than the 384 that 115200 baud carries at 30 fps, so
+ * it's 500000 (exact on a 16MHz board, and the Uno's USB chip keeps up).
+ * Each frame gets at most CAPTURE_FRAME_BYTES of that.
+ * CAPTURE_BUF_BYTES of arduino memory wait to go out and CAPTURE_REFRESH_PIX
+ * pixels a frame are sent whole, so a decoder that lost track of a pixel gets
+ * it back.
+ */
+//#define USE_CAPTURE
+#ifndef CAPTURE_BAUD
+#define CAPTURE_BAUD 500000
+#endif
+#ifndef CAPTURE_FRAME_BYTES
+#define CAPTURE_FRAME_BYTES 600
+#endif
+#ifndef CAPTURE_BUF_BYTES
+#define CAPTURE_BUF_BYTES 128
+#endif
+#ifndef CAPTURE_REFRESH_PIX
+#define CAPTURE_REFRESH_PIX 8
+#endif
+
+/*Uncomment to save the frame and the rain's state to EEPROM every
+ * SNAPSHOT_SECONDS and pick up from there at power up, rather than start over
+ * from blank or from whatever the RAM powers up holding (see snapshot.h).  An
+ * EEPROM byte is good for about 100,000 writes, and a save writes each byte
+ * once at most, so once every 15 minutes (96 a day) is nearly 3 years running
+ * day and night.  The snapshot takes SNAPSHOT_EEPROM_BYTES from SNAPSHOT_ADDR
+ * on: 1K, all of it, on an Uno.
+ */
+//#define USE_SNAPSHOT
+#ifndef SNAPSHOT_SECONDS
+#define SNAPSHOT_SECONDS 900
+#endif
+#ifndef SNAPSHOT_ADDR
+#define SNAPSHOT_ADDR 0
+#endif
+#ifndef SNAPSHOT_EEPROM_BYTES
+#define SNAPSHOT_EEPROM_BYTES 1024
+#endif
+
+/*Most of our 2K that the pix array may take when it's in arduino memory.  The
+ * rest is for the stack, globals and the libraries, and BRITE_TABLE's 256
+ * bytes if it's on.  (The host build has memory to spare and raises it to
+ * compare a big strip in SPI RAM with the same strip in arduino memory.)
+ */
+#ifndef PIX_SRAM_BYTES
+#define PIX_SRAM_BYTES 1200
+#endif
+
+/*When the pix array is in SPI memory, PixelArray keeps this many pixels in 
+ * arduino memory as a write-back cache (4 bytes each out of our 2K).  Single
+ * pixel get() and set() calls then cost a bus transaction per window rather
+ * than per pixel.  Set to 0 to go straight to the chip every time.
+ */
+#ifndef PIX_CACHE_PIX
+#define PIX_CACHE_PIX 16
+#endif
+
+/*Writing back changed pixels, this many unchanged ones between two changed
+ * ones get written anyway rather than starting a new burst.  A burst costs a
+ * command and an address (3 bytes) on SPI and two chip selects, about 10us in
+ * all, so one pixel (6 or 8us) is cheaper to rewrite and two aren't.  At 388
+ * LEDs that's 66 bursts a frame where writing each span's first to last
+ * changed pixel in one burst was 51, but 96 fewer bytes: the bench models
+ * 9552us of SPI a frame against 9687.  0 is 108 bursts and 9636us, 2 is 55
+ * and 9615us.
+ */
+#ifndef WRITE_MERGE_PIX
+#define WRITE_MERGE_PIX 1
+#endif
+
+/*The strip length is a #define so a build can override it without editing this
+ * file, e.g. the host benchmark builds one binary per strip length.
+ */
+#ifndef CONFIG_NUM_LEDS
+#define CONFIG_NUM_LEDS 388
+#endif
+
+/*The strip can be split across several pins of the LED port, all driven at
+ * once (see LitePixel::sendLanes).  Lane 0 is on CONFIG_PIN_LED, lane 1 on the
+ * next pin up and so on, and each lane carries the next LANE_PIX pixels of the
+ * strip.  8 lanes send a frame in an eighth of the time of 1.  Lanes have to
+ * stay on the one port, so 8 lanes on PORTD means pins 0-7 and no Serial.
+ * They need the pixels in arduino memory (no USE_SPI_MEM): every lane is read
+ * while the strip waits, and over SPI that's longer than the latch.
+ */
+#ifndef LED_LANES
+#define LED_LANES 1
+#endif
+
+#ifndef CONFIG_PIN_LED
+#define CONFIG_PIN_LED 6
+#endif
+
+/*Frames a second loop() aims for (see scheduler.h).  0 runs flat out, the
+ * way it used to.
+ */
+#ifndef CONFIG_TARGET_FPS
+#define CONFIG_TARGET_FPS 30
+#endif
+
+/*How the stored pixels are laid out on the strip (see pixmap.h and PIX_MAP
+ * below).  0 is one stored pixel per LED, as always.  The others store and
+ * walk fewer pixels and show them more than once:
+ *   1 mirror:  the first half of the strip, then the same again backwards.
+ *   2 tile:    a quarter of the strip, four times over.
+ *   3 stretch: half as many pixels, each on two LEDs.
+ * Or write your own segments into PIX_MAP.
+ */
+#ifndef PIX_MAP_PRESET
+#define PIX_MAP_PRESET 0
+#endif
+
 #include "color.h"  //Our color datatype.
 #include "pixelarray.h" 
+#include "pixmap.h"
 
 namespace CONFIG 
 {
   //Hardware constants
   /*SPI RAM Also uses the pins 11, 12, and 13 on the arduino*/
   const short PIN_SPIRAM = 10;  //The data pin for talking to extended memory module.
-  const short PIN_LED = 6;  //Pin connecting the IN on the LED strip to the CPU board.
-  const short NUM_LEDS = 388; //Num LEDS in our array.
+  const short PIN_LED = CONFIG_PIN_LED;  //Pin connecting the IN on the LED strip (lane 0) to the CPU board.
+  const short NUM_LEDS = CONFIG_NUM_LEDS; //Num LEDS in our array.
+
+  /*The strip, segment by segment: { first pixel, pixels, LEDs each, reversed }.
+   * See pixmap.h.  It decides how many pixels we store, NUM_PIX.
+   */
+  constexpr Segment PIX_MAP[] = {
+#if PIX_MAP_PRESET == 1
+    { 0, NUM_LEDS / 2, 1, false },
+    { 0, NUM_LEDS / 2, 1, true },
+#elif PIX_MAP_PRESET == 2
+    { 0, NUM_LEDS / 4, 1, false },
+    { 0, NUM_LEDS / 4, 1, false },
+    { 0, NUM_LEDS / 4, 1, false },
+    { 0, NUM_LEDS / 4, 1, false },
+#elif PIX_MAP_PRESET == 3
+    { 0, NUM_LEDS / 2, 2, false },
+#else
+    { 0, NUM_LEDS, 1, false },
+#endif
+  };
+  const byte PIX_SEGMENTS = sizeof(PIX_MAP) / sizeof(PIX_MAP[0]);
+  const short NUM_PIX = segmentPix(PIX_MAP, PIX_SEGMENTS);  //Pixels we store and walk.
+  static_assert(segmentLeds(PIX_MAP, PIX_SEGMENTS) == NUM_LEDS, "PIX_MAP must cover exactly NUM_LEDS LEDs (a preset may need NUM_LEDS to divide evenly)");
+
+  const short LANE_PIX = (NUM_LEDS + LED_LANES - 1) / LED_LANES;  //Pixels per lane, rounded up.
+  const byte LANE_MASK = ((1 << LED_LANES) - 1) << PIN_LED;  //Every lane's bit on the LED port.
+  static_assert(PIN_LED + LED_LANES <= 8, "LED lanes must all fit on the one 8 bit port");
+#ifdef USE_SPI_MEM
+  static_assert(SPI_BANKS < 4 || PIN_LED + LED_LANES <= 7, "The 4th SPI RAM bank's chip select (pin 7) is an LED lane");
+#endif
+
+  /*Loops that sweep the whole strip move pixels in spans of this many at a
+   * time (see PixelArray::getSpan).  Each span is a buffer on the stack, 4 bytes
+   * per pixel.  A single strip streams its pixels straight off storage, but
+   * the multi-lane display and stream mode read EMIT_SPAN_PIX pixels at a
+   * time between two pixels on the wire with interrupts off, so it must stay
+   * small enough that the read finishes inside the strip's latch time.  Over
+   * SPI a read is a command, an address and 4 bytes a pixel at 2us a byte:
+   * 19 bytes, about 38us, at 4 pixels (SPAN_READ_US below counts it).  Lanes
+   * read from arduino memory, one lane's span in each of the first LED_LANES
+   * gaps of the span before.
+   */
+  const short SPAN_PIX = 16;
+  const short EMIT_SPAN_PIX = 4;
+
+  const uint16_t TARGET_FPS = CONFIG_TARGET_FPS;
   
   //Global Variables
-  byte MAX_BRITE=255;  //The brightest we want our display to get. 
+  /*The brightest we want our display to get.  LitePixel::setup builds its
+   * table from it; change it later with lite.setBrightness().
+   */
+  byte MAX_BRITE=CONFIG_MAX_BRITE;
+
+  /*The storage decisions above become the type of pix, so the compiler sees
+   * exactly one way of storing pixels and builds only that one.
+   */
+#ifdef USE_PACKED_PIX
+  typedef WireLayout PixLayout;
+#else
+  typedef ColorLayout PixLayout;
+#endif
+#ifdef USE_SPI_MEM
+  typedef SpiStore<PixLayout> PixStore;
+#else
+  typedef SramStore<PixLayout> PixStore;
+#endif
+  typedef PixelArray<PixStore, NoFlags, PIX_FRAMES> PixArray;
+  PixArray pix(NUM_PIX);
+  PixelMap<PixArray, EMIT_SPAN_PIX> pixMap(pix, PIX_MAP, PIX_SEGMENTS);  //pix as the strip shows it.
 
-  PixelArray pix(NUM_LEDS, 1, 0, 0); //Either pointer to buffer  or offset for spiram.
+  /*What reading or writing pixels costs while the strip waits, so the gaps on
+   * the wire can be held to its latch time (LATCH_US above).  These
+   * are counted, not measured; the host bench's 'max gap spi B' is the
+   * measured side.  An SPI byte is 2us (SPI_CLOCK_DIV4 at 16MHz).  A burst
+   * adds a command and an address, and its two chip selects (digitalWrite)
+   * come to about 4us.  From arduino memory it's the calls more than the
+   * bytes: about 6us a read and 1us a pixel.
+   */
+  const int SPI_BYTE_US = 2;
+#ifdef USE_SPI_MEM
+  const int BURST_US = (1 + spiMem::ADDR_BYTES) * SPI_BYTE_US + 4;
+  const int PIX_US = PixLayout::BYTES * SPI_BYTE_US;
+#else
+  const int BURST_US = 6;
+  const int PIX_US = 1;
+#endif
+  const int SPAN_READ_US = BURST_US + EMIT_SPAN_PIX * PIX_US;  //A span of EMIT_SPAN_PIX.
 };
 
 #else  //CONFIG_H 
@@ -64,7 +396,10 @@ namespace CONFIG
 namespace CONFIG
 {
   extern const short NUM_LEDS;
+  extern const short NUM_PIX;
   extern const short PIN_LED;
+  extern const short LANE_PIX;
+  extern const byte LANE_MASK;
 };
 
 #endif //CONFIG_H
@@ -0,0 +1,359 @@
+/*capture.h
+ * What did the wall actually show?  With USE_CAPTURE defined (see CONFIG.h)
+ * the rain sends every change it makes to a pixel over Serial, and
+ * host/capdump puts the frames back together from them.
+ *
+ * Whole frames are far too much for the serial port: 388 pixels are 1164
+ * bytes, 35K a second at 30 fps, where 500000 baud carries 50K and 115200 only
+ * 11.5K.  But the rain only ever moves a channel by 1, so a changed pixel is
+ * three 2 bit steps, 6 bits.  The walk already knows which pixels changed (it only writes
+ * those back), so at that moment it hands them here as well:
+ *
+ *   CAPTURE_PIXEL(id, was, now);  //From the walk, for each pixel it changed.
+ *   CAPTURE_PUMP();    //Now and then: move what's waiting into Serial.
+ *   CAPTURE_FRAME();   //Once a frame, from loop().
+ *
+ * Like telemetry.h's, the hooks are nothing at all without USE_CAPTURE.
+ *
+ * It never makes the frame wait.  Each frame gets CAPTURE_FRAME_BYTES at most,
+ * they wait in a CAPTURE_BUF_BYTES ring, and only as many go to Serial as its
+ * transmit buffer has room for right then, between spans of the walk and in
+ * the scheduler's wait at the end of the frame (a Serial.write() with no room waits
+ * for the bytes ahead of it to go).  What doesn't fit isn't sent, and the
+ * frame says which pixels it left out so the decoder knows it has lost them.
+ * It gets them back from the CAPTURE_REFRESH_PIX pixels each frame sends
+ * whole, going round the strip.  The pixels are the logical ones, before any
+ * PIX_MAP.
+ */
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "CONFIG.h"
+
+#ifdef USE_CAPTURE
+
+#ifdef USE_TELEMETRY
+#error "USE_CAPTURE and USE_TELEMETRY both want Serial to themselves"
+#endif
+
+/*The stream is records, each a tag byte and what follows, little-endian:
+ *   'F' seq            a frame starts.  seq counts frames, sent or not, so a
+ *                      gap is one that didn't fit.
+ *   'H' version pixels(uint16)   which format, how many pixels.  Every time the
+ *                      refresh goes back to pixel 0.
+ *   'D' first(uint16) count  then count pixels from first: 2 bits a channel,
+ *                      red, green, blue, from bit 0 up: 0 same, 1 up one,
+ *                      2 down one, 3 changed some other way (the decoder
+ *                      loses it).  Pixels in gaps of a run didn't change.
+ *   'T' lo(uint16) hi(uint16)    pixels between lo and hi may have changed
+ *                      and weren't sent.
+ *   'R' first(uint16) count  then red, green, blue of count pixels as they
+ *                      are at the end of the frame.
+ *   'E' sum            the frame is done.  sum is of every byte from its 'F'
+ *                      to here.
+ */
+class Capture
+{
+public:
+  static const byte VERSION = 1;
+  static const byte MAX_RUN = 16;  //Pixels a 'D' record takes at most.
+  static const byte MAX_GAP = 3;   //Unchanged pixels a run takes rather than start another (4 bytes).
+
+  Capture();
+  void begin();    //From setup(), once the pixels are in place.
+  inline void pixel(int id, uint32_t was, uint32_t now);
+  void pump();     //As much of the ring into Serial as fits without waiting.
+  void frame();    //Finish this frame's record and start the next.
+  bool idle();     //For FrameScheduler::endFrame: pump while there's anything to.
+  unsigned long frames() { return mFrames; }       //Sent whole, 'F' to 'E'.
+  unsigned long skipped() { return mSkipped; }     //No room even to start.
+  unsigned long truncated() { return mTruncated; } //Sent with a 'T'.
+  unsigned long bytes() { return mBytes; }
+private:
+  static const byte TAIL = 7;  //'T' and 'E' records, kept free so a frame can always end.
+  inline bool room(int len);
+  inline void put(byte b);
+  void put16(int v);
+  void startFrame();
+  void flushRun();
+
+  byte mRing[CAPTURE_BUF_BYTES];  //Waiting to go out.
+  int mHead;        //Oldest byte in mRing.
+  int mCount;       //Bytes in mRing.
+  int mFrameBytes;  //Put this frame.
+  byte mSum;
+  byte mSeq;
+  bool mStarting;   //This frame's 'F' is still to go in, at its first pixel.
+  bool mInFrame;    //This frame's 'F' went in the ring.
+  bool mTrunc;      //A run didn't fit; everything after it this frame goes in the 'T'.
+  int mLo;
+  int mHi;
+  int mRunFirst;    //The run being built: its first pixel,
+  byte mRunCount;   //how far it goes,
+  byte mRun[(MAX_RUN * 6 + 7) / 8];  //and its steps.
+  int mRefresh;     //Next pixel to send whole.
+  unsigned long mFrames;
+  unsigned long mSkipped;
+  unsigned long mTruncated;
+  unsigned long mBytes;
+};
+
+Capture::Capture() : mHead(0), mCount(0), mFrameBytes(0), mSum(0), mSeq(0), mStarting(false), mInFrame(false),
+                     mTrunc(false),
+                     mRunCount(0), mRefresh(0), mFrames(0), mSkipped(0), mTruncated(0), mBytes(0)
+{
+}
+
+void Capture::begin()
+{
+  Serial.begin(CAPTURE_BAUD);
+  frame();
+}
+
+//Room for len more bytes this frame, in the ring and in the frame's budget, and still end it.
+inline bool Capture::room(int len)
+{
+  return mCount + len + TAIL <= CAPTURE_BUF_BYTES && mFrameBytes + len + TAIL <= CAPTURE_FRAME_BYTES;
+}
+
+inline void Capture::put(byte b)
+{
+  mRing[(mHead + mCount) % CAPTURE_BUF_BYTES] = b;
+  ++mCount;
+  ++mFrameBytes;
+  mSum += b;
+}
+
+void Capture::put16(int v)
+{
+  put(v & 0xFF);
+  put(v >> 8);
+}
+
+/*Pixels come in order along the strip.  One next to the run, or a few
+ * unchanged ones past its end, carries the run on; anything else starts a new
+ * one.
+ */
+inline void Capture::pixel(int id, uint32_t was, uint32_t now)
+{
+  if (was == now)  //A back frame has every pixel written, changed or not.
+  {
+    return;
+  }
+  if (mStarting)
+  {
+    startFrame();
+  }
+  if (!mInFrame)
+  {
+    return;
+  }
+  if (mTrunc)
+  {
+    mHi = id;
+    return;
+  }
+  int at = id - mRunFirst;  //Where id goes in the run.
+  if (mRunCount && (at < mRunCount || at >= MAX_RUN || at > mRunCount + MAX_GAP))
+  {
+    flushRun();
+    if (mTrunc)
+    {
+      mHi = id;
+      return;
+    }
+  }
+  if (!mRunCount)
+  {
+    mRunFirst = id;
+    at = 0;
+    memset(mRun, 0, sizeof(mRun));
+  }
+  COLOR w;
+  COLOR n;
+  w.l = was;
+  n.l = now;
+  for (byte c=0; c<3; ++c)
+  {
+    byte step = n.c[c] == w.c[c] ? 0 : n.c[c] == (byte)(w.c[c] + 1) ? 1 : n.c[c] == (byte)(w.c[c] - 1) ? 2 : 3;
+    int bit = 6 * at + 2 * c;
+    mRun[bit >> 3] |= step << (bit & 7);
+  }
+  mRunCount = at + 1;
+}
+
+//The run goes in the ring if there's room, or starts the 'T' if not.
+void Capture::flushRun()
+{
+  if (!mRunCount)
+  {
+    return;
+  }
+  int steps = (6 * mRunCount + 7) / 8;
+  if (room(4 + steps))
+  {
+    put('D');
+    put16(mRunFirst);
+    put(mRunCount);
+    for (int i=0; i<steps; ++i)
+    {
+      put(mRun[i]);
+    }
+  }
+  else
+  {
+    mTrunc = true;
+    mLo = mRunFirst;
+    mHi = mRunFirst + mRunCount - 1;
+  }
+  mRunCount = 0;
+}
+
+/*Serial.availableForWrite() is how much the transmit buffer takes without
+ * waiting.  On the board the buffer empties by interrupt in the background,
+ * except while display_pix has interrupts off.
+ */
+void Capture::pump()
+{
+  int n = Serial.availableForWrite();
+  while (n > 0 && mCount > 0)
+  {
+    int chunk = CAPTURE_BUF_BYTES - mHead;  //Up to the end of the ring, at most.
+    if (chunk > mCount)
+    {
+      chunk = mCount;
+    }
+    if (chunk > n)
+    {
+      chunk = n;
+    }
+    Serial.write(mRing + mHead, chunk);
+    mHead = (mHead + chunk) % CAPTURE_BUF_BYTES;
+    mCount -= chunk;
+    mBytes += chunk;
+    n -= chunk;
+  }
+}
+
+/*The scheduler's wait at the end of a frame is the best time to feed Serial,
+ * and the only long one with interrupts on.  While Serial has no room we wait
+ * a byte's time rather than spin.
+ */
+bool Capture::idle()
+{
+  pump();
+  if (mCount == 0)
+  {
+    return false;
+  }
+  delayMicroseconds(10000000UL / CAPTURE_BAUD);
+  return true;
+}
+
+/*A frame's 'F' goes in at its first changed pixel rather than at the end of
+ * the last frame, so what the last one left in the ring has had the
+ * scheduler's wait to go out.  If there still isn't room for it, the frame
+ * isn't sent at all.
+ */
+void Capture::startFrame()
+{
+  mStarting = false;
+  mFrameBytes = 0;
+  mSum = 0;
+  mTrunc = false;
+  mRunCount = 0;
+  int header = mRefresh == 0 ? 6 : 2;
+  mInFrame = mCount + header + TAIL <= CAPTURE_BUF_BYTES;
+  if (!mInFrame)
+  {
+    ++mSkipped;
+    return;
+  }
+  put('F');
+  put(mSeq);
+  if (mRefresh == 0)
+  {
+    put('H');
+    put(VERSION);
+    put16(CONFIG::NUM_PIX);
+  }
+}
+
+/*The end of a frame is its 'T', a refresh slice with what budget is left and
+ * the 'E'.
+ */
+void Capture::frame()
+{
+  if (mStarting)  //Nothing changed, but the frame still counts.
+  {
+    startFrame();
+  }
+  if (mInFrame)
+  {
+    flushRun();
+    if (mTrunc)
+    {
+      put('T');
+      put16(mLo);
+      put16(mHi);
+      ++mTruncated;
+    }
+    int n = (CAPTURE_FRAME_BYTES - mFrameBytes - 2 - 4) / 3;  //Pixels the budget has room for,
+    int ring = (CAPTURE_BUF_BYTES - mCount - 2 - 4) / 3;      //and the ring.
+    if (n > ring)
+    {
+      n = ring;
+    }
+    if (n > CAPTURE_REFRESH_PIX)
+    {
+      n = CAPTURE_REFRESH_PIX;
+    }
+    if (n > CONFIG::NUM_PIX - mRefresh)
+    {
+      n = CONFIG::NUM_PIX - mRefresh;
+    }
+    if (n > 0)
+    {
+      COLOR px[CAPTURE_REFRESH_PIX];
+      CONFIG::pix.getSpan(mRefresh, n, px);
+      put('R');
+      put16(mRefresh);
+      put(n);
+      for (int i=0; i<n; ++i)
+      {
+        put(px[i].c[0]);
+        put(px[i].c[1]);
+        put(px[i].c[2]);
+      }
+      mRefresh += n;
+      if (mRefresh >= CONFIG::NUM_PIX)
+      {
+        mRefresh = 0;
+      }
+    }
+    byte sum = mSum;
+    put('E');
+    put(sum);
+    ++mFrames;
+    mInFrame = false;
+  }
+  ++mSeq;
+  mStarting = true;
+  pump();
+}
+
+Capture cap;
+
+#define CAPTURE_PIXEL(id, was, now) cap.pixel(id, was, now)
+#define CAPTURE_PUMP() cap.pump()
+#define CAPTURE_FRAME() cap.frame()
+
+#else  //USE_CAPTURE
+
+#define CAPTURE_PIXEL(id, was, now)
+#define CAPTURE_PUMP()
+#define CAPTURE_FRAME()
+
+#endif //USE_CAPTURE
+
+#endif //CAPTURE_H
@@ -14,8 +14,30 @@ in a later version to compare the relative merits of each model.
 
 typedef union COLOR_T
 {
-  unsigned long l;    //long representation.  It's bytes overlap the memory of the chars.
+  uint32_t l;    //long representation (unsigned long on AVR).  It's bytes overlap the memory of the chars.
   byte c[4]; //byte representation. 0-255 intensity for R G B and a spare 
 } COLOR;
 
+/*The LED strip doesn't want RGB.  It wants green, then red, then blue, and it
+ * has no use for our spare byte.  colorToWire and wireToColor translate between
+ * a COLOR and those three bytes, so we can store pixels in the order they go 
+ * out on the wire (see USE_PACKED_PIX in CONFIG.h).
+ */
+inline void colorToWire(byte* wire, COLOR col)
+{
+  wire[0] = col.c[1];
+  wire[1] = col.c[0];
+  wire[2] = col.c[2];
+}
+
+inline COLOR wireToColor(const byte* wire)
+{
+  COLOR col;
+  col.c[0] = wire[1];
+  col.c[1] = wire[0];
+  col.c[2] = wire[2];
+  col.c[3] = 0;
+  return col;
+}
+
 #endif //COLOR_H
@@ -14,47 +14,162 @@
 #include "CONFIG.h"
 #include "rain.h"  //The digital rain algorithm
 #include "litepixel.h"
+#ifdef STREAM_RENDER
+#include "stream.h"   //Rain and display in one pass.
+#endif
+#include "scheduler.h"  //Steady frame rate.
+#include "telemetry.h"  //Where the time goes, when USE_TELEMETRY is on.
+#ifdef USE_SNAPSHOT
+#include "snapshot.h"   //Carry on after a power cycle.
+#endif
+#include "capture.h"    //The frames over Serial, when USE_CAPTURE is on.
 
 //TODO protect globals in V3.
 //Global variables
 Rain rain;           //Container class for rain algorithm.  See rain.h for details
 LitePixel lite;
+FrameScheduler sched(CONFIG::TARGET_FPS);
+#ifdef USE_SNAPSHOT
+Snapshot snap;
+#endif
 
 void setup() {       //Builtin function run once at start of app.
   Serial.begin(9600); //Open serial(Com speed) Useful for debug but watch string memory use.
 
   lite.setup(); //Initialize communication with WS281* chain.
+#ifdef USE_SNAPSHOT
+  snap.restore(rain);  //The frame we last saved, if there is one.
+#endif
+  rain.setup(); //Take stock of whatever is in the pix array.
+#ifdef USE_CAPTURE
+  cap.begin();  //From the pixels as they are now.
+#endif
 }
 
 void loop() { //Builtin function.
-  rain.loopStep();
+  sched.beginFrame();
+#ifdef STREAM_RENDER
+  stream_pix(lite, rain);  //Step, latch and send all at once.
+  CONFIG::pix.swap();
+  sched.endStage(FrameScheduler::EMIT);
+#else
+  int stepped = rain.step(sched.stepBudget(CONFIG::NUM_PIX));
+  sched.endStage(FrameScheduler::STEP, stepped);
+  CONFIG::pix.swap();  //What the rain just worked out is what we show.
+  lite.waitLatch(rain);
+  sched.endStage(FrameScheduler::LATCH);
   display_pix();
-  //TODO:
-  /*
-   * This delay is hard-coded and we have to recompile and re-upload any time
-   * we want to change it.  A variable control would be cool.  In V3 we'll 
-   * think of that control as a discrete concept and discuss implementing it
-   * over serial, potentiometer, or digital signal and some example uses of 
-   * each.
+  sched.endStage(FrameScheduler::EMIT);
+#endif
+  /*This used to be a hard-coded delay(50) that we had to recompile and
+   * re-upload to change.  The scheduler works out the wait from TARGET_FPS
+   * (CONFIG.h), and sched.setTarget() can change it as we go: over serial,
+   * from a potentiometer or a digital signal.
    */
-  //delay(50);
+#ifdef USE_SNAPSHOT
+  snap.poll(rain);
+#endif
+  TELE_FRAME(sched.missed());
+  CAPTURE_FRAME();
+#ifdef USE_CAPTURE
+  sched.endFrame(cap);  //Feeding Serial while we wait.
+#else
+  sched.endFrame();
+#endif
 }
 
 /*display_pix transcribes the contents of the pix array to the LED driver hardware.
- * In some future version we may want different display routines for stateless 
- * patterns or scaling, mirroring, compressing and otherwise distorting part of a 
- * pattern and projecting it across the array.
+ * It goes by way of CONFIG::pixMap, which can scale, mirror and repeat part of
+ * a pattern to project it across the array (see pixmap.h).  Stateless
+ * patterns have stream_pix.
  */
  
+#if LED_LANES > 1 && defined(USE_SPI_MEM)
+#error "LED lanes read every lane between two pixels, which over SPI is longer than the latch; keep the pixels in arduino memory (no USE_SPI_MEM) or set LED_LANES to 1"
+#endif
+
+#if LED_LANES > 1
+/*The next count pixels of one lane, from first along it, in wire order.  The
+ * last lane can come up short; past the end of the strip is black.
+ */
+static void read_lane(byte* wire, int lane, int first, int count)
+{
+  int start = lane * CONFIG::LANE_PIX + first;
+  int have = CONFIG::NUM_LEDS - start;
+  if (have > count)
+  {
+    have = count;
+  }
+  if (have > 0)
+  {
+    CONFIG::pixMap.getWire(start, have, wire);
+  }
+  else
+  {
+    have = 0;
+  }
+  memset(wire + have * 3, 0, (count - have) * 3);
+}
+#endif
+
 void display_pix()
 {
+  TELE_BEGIN(Telemetry::DISPLAY);
+  lite.waitLatch(rain);  //Usually long done: the rain step takes far longer.
+#if LED_LANES > 1
+  /*Pixels already in green, red, blue order, a span per lane, two spans of
+   * them: one going out and the next coming in.  The lanes are far apart in
+   * memory so each is a read of its own, and we make one of them after each
+   * of the first LED_LANES bytes of the span going out, so no gap between two
+   * bytes holds more than one.  The gap after the span's last byte holds no
+   * read, and that's where interrupts get their look in.
+   */
+  static_assert(CONFIG::EMIT_SPAN_PIX * 3 > LED_LANES, "A span has to have a byte for each lane's read and one more for interrupts");
+  const int SPAN = CONFIG::EMIT_SPAN_PIX;
+  byte wire[2][LED_LANES][SPAN * 3];
+  for (int lane=0;lane<LED_LANES;++lane)
+  {
+    read_lane(wire[0][lane], lane, 0, SPAN);  //Nothing on the wire yet to keep waiting.
+  }
   cli();
-  for (int i=0;i<CONFIG::NUM_LEDS;++i)
+  for (int first=0;first<CONFIG::LANE_PIX;first+=SPAN)
   {
-    COLOR c;
-    c = CONFIG::pix.get(i);
-    lite.sendPixel( c.c[0], c.c[1], c.c[2]);
+    int count = CONFIG::LANE_PIX - first;
+    if (count > SPAN)
+    {
+      count = SPAN;
+    }
+    byte (*now)[SPAN * 3] = wire[(first / SPAN) & 1];
+    byte (*next)[SPAN * 3] = wire[((first / SPAN) & 1) ^ 1];
+    bool more = first + SPAN < CONFIG::LANE_PIX;
+    for (int i=0;i<count * 3;++i)
+    {
+      lite.sendLaneBytes(now[0] + i, sizeof(now[0]), 1);
+      if (more && i < LED_LANES)
+      {
+        read_lane(next[i], i, first + SPAN, SPAN);
+      }
+    }
+#if EMIT_GROUP_PIX > 0
+    lite.letInterruptsIn();
+#endif
   }
   sei();
+#else
+  /*One lane is the whole strip in order, which is how it sits in memory, so
+   * the frame goes from storage to the strip a byte at a time.  From SPI RAM
+   * that's a single stream read for the whole frame (or one per segment of a
+   * PIX_MAP that shows its pixels once each, in order).
+   */
+  cli();
+#if EMIT_GROUP_PIX > 0
+  EmitGroups groups(lite);  //Interrupts get a look in between groups of pixels.
+  CONFIG::pixMap.sendWire(groups);
+#else
+  CONFIG::pixMap.sendWire(lite);
+#endif
+  sei();
+#endif
   lite.show();
+  TELE_END(Telemetry::DISPLAY);
 }
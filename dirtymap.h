@@ -0,0 +1,167 @@
+/*dirtymap.h
+ * One bit per pixel: has it changed since we last cleared the map?
+ *
+ * Whoever writes pixels marks them, whoever wants to know what changed asks.
+ * The asking is by runs: nextRun() finds the next stretch of changed pixels,
+ * so a write-back can send just those stretches and skip the rest.
+ *
+ * 8 pixels share a byte.  Pixel id is bit id%8 of byte id/8, so bytes hold
+ * pixels in order and a whole byte of 0 is 8 clean pixels we can skip in one
+ * compare.
+ */
+#ifndef DIRTYMAP_H
+#define DIRTYMAP_H
+
+#include "color.h"
+
+class DirtyMap
+{
+private:
+  byte* mBits;  //(mNumPix+7)/8 bytes, or NULL if alloc() failed.
+  int mNumPix;
+public:
+  DirtyMap() : mBits(NULL), mNumPix(0) {}
+  ~DirtyMap() { free(mBits); }
+  bool alloc(int num_pix);           //Room for num_pix pixels, all clean.
+  inline void mark(int id);          //Pixel id changed.
+  void markRange(int first, int count);
+  inline bool test(int id);          //Has pixel id changed?
+  inline byte get(int id);           //The 8 bits for pixels id&~7 to id|7.
+  void clear();                      //Everything clean again.
+  int count();                       //How many pixels have changed.
+  bool any();                        //Has anything changed?
+  int nextRun(int from, int& count, int mergeGap = 0);  //See below.
+  //So a DirtyMap can be PixelArray's Flags.
+  inline void clear(int /*num_pix*/) { clear(); }
+private:
+  inline int bytes() { return (mNumPix + 7) / 8; }  //Divide and round up.
+  DirtyMap(const DirtyMap&);             //No copies: both would free mBits.
+  DirtyMap& operator=(const DirtyMap&);
+};
+
+bool DirtyMap::alloc(int num_pix)
+{
+  free(mBits);
+  mNumPix = num_pix;
+  mBits = (byte*)malloc(bytes());
+  if (mBits == NULL)
+  {
+    mNumPix = 0;  //Every call below then does nothing.
+    return false;
+  }
+  clear();
+  return true;
+}
+
+inline void DirtyMap::mark(int id)
+{
+  if (id >= 0 && id < mNumPix)
+  {
+    mBits[id >> 3] |= 1 << (id & 7);
+  }
+}
+
+void DirtyMap::markRange(int first, int count)
+{
+  for (int i=0; i<count; ++i)
+  {
+    mark(first + i);
+  }
+}
+
+inline bool DirtyMap::test(int id)
+{
+  if (id < 0 || id >= mNumPix)
+  {
+    return false;
+  }
+  return (mBits[id >> 3] >> (id & 7)) & 1;
+}
+
+inline byte DirtyMap::get(int id)
+{
+  if (id < 0 || id >= mNumPix)
+  {
+    return 0;
+  }
+  return mBits[id >> 3];
+}
+
+void DirtyMap::clear()
+{
+  if (mBits)
+  {
+    memset(mBits, 0, bytes());
+  }
+}
+
+int DirtyMap::count()
+{
+  int total = 0;
+  for (int i=0; i<bytes(); ++i)
+  {
+    byte b = mBits[i];
+    while (b)
+    {
+      b &= b - 1;  //Knocks off the lowest set bit.
+      ++total;
+    }
+  }
+  return total;
+}
+
+bool DirtyMap::any()
+{
+  for (int i=0; i<bytes(); ++i)
+  {
+    if (mBits[i])
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*nextRun finds the first changed pixel at or after from and returns its id,
+ * with count set to how many pixels the run covers.  Returns -1 (count 0) when
+ * nothing after from has changed.
+ *
+ * mergeGap lets a run carry on over up to that many clean pixels when more
+ * changed ones follow.  Every burst on the SPI bus costs a command and an
+ * address, so rewriting a clean pixel or two can be cheaper than starting
+ * another burst.
+ *
+ * To walk every run:
+ *   int n;
+ *   for (int id=map.nextRun(0, n); id>=0; id=map.nextRun(id+n, n)) ...
+ */
+int DirtyMap::nextRun(int from, int& count, int mergeGap)
+{
+  count = 0;
+  int id = from < 0 ? 0 : from;
+  while (id < mNumPix && !(mBits[id >> 3] >> (id & 7)))  //Nothing left in this byte?
+  {
+    id = (id | 7) + 1;  //Skip to the next byte.
+  }
+  while (id < mNumPix && !test(id))
+  {
+    ++id;
+  }
+  if (id >= mNumPix)
+  {
+    return -1;
+  }
+  int first = id;
+  int last = id;    //Last changed pixel in the run so far.
+  for (++id; id < mNumPix && id - last <= mergeGap + 1; ++id)
+  {
+    if (test(id))
+    {
+      last = id;
+    }
+  }
+  count = last - first + 1;
+  return first;
+}
+
+#endif //DIRTYMAP_H
@@ -0,0 +1,179 @@
+//fastrand.h
+//A cheap, seedable source of the coin tosses rain needs.
+
+/*Arduino's random(n) runs a 32 bit Park-Miller step (two 32 bit divides on a
+ * CPU with no divide instruction) and then a 32 bit modulo, every call.  The
+ * rain walk used to call it two or three times per pixel per frame, which made
+ * it the most expensive thing we did.
+ *
+ * FastRand is a 32 bit xorshift: three shifts and three XORs per word.  Rather
+ * than ask for one number at a time, the walk asks for a whole word per pixel
+ * and treats each byte as that channel's draw (a 'lane').  A lane byte turns
+ * into a step of -1/0/+1 or a 1-in-5 coin flip with a single compare, no
+ * division at all.
+ *
+ * The same seed always gives the same sequence, so a run can be replayed.
+ */
+
+#ifndef FASTRAND_H
+#define FASTRAND_H
+
+#include "color.h"
+#ifdef HOST_SIM
+#include <Sim.h>  //Host build: counts the steps made while the walk waits.
+#endif
+
+class FastRand
+{
+public:
+  static const uint32_t DEFAULT_SEED = 0x2545F491UL;
+
+  FastRand(uint32_t seed = DEFAULT_SEED);
+  void seed(uint32_t seed);   //Restart the sequence.  0 is replaced by DEFAULT_SEED.
+  uint32_t state();           //Pass to seed() later to carry on from here.
+  inline uint32_t next();     //32 fresh random bits.
+  bool prefill();             //Make one word ahead of time.  False when there's no room.
+  inline uint32_t lanes();    //One draw byte per channel: byte c is channel c's lane.
+  inline bool oneIn(uint16_t n);  //True with odds 1 in n.
+  inline byte below(byte n);  //0 to n-1.
+
+  /*Lane decoders.  Thresholds are picked so each is a single compare.*/
+  static inline signed char trit(byte lane);  //-1, 0 or +1, a third each.
+  static inline bool drain(byte lane);        //True about 1 time in 5.
+
+  static const byte TRIT_DOWN = 85;   //lane < 85 steps down (85 of 256)
+  static const byte TRIT_UP = 171;    //lane >= 171 steps up (85 of 256)
+  static const byte DRAIN_ODDS = 51;  //lane < 51 drains (51 of 256, 1 in 5.02)
+
+  static const byte AHEAD = 8;  //Words prefill() can keep ready.
+
+private:
+  uint32_t mState;
+  uint32_t mLast;     //The last word next() handed out: where the caller is in the sequence.
+  uint32_t mAhead[AHEAD];  //Ring of words made by prefill(), in sequence order.
+  byte mAheadFirst;   //Oldest word in mAhead.
+  byte mAheadCount;
+  inline uint32_t step();  //Move mState along one.
+  uint32_t mPool;     //Bits left over from the last word for oneIn() and below().
+  byte mPoolBits;     //How many of them.
+  inline uint16_t take(byte bits);
+};
+
+FastRand::FastRand(uint32_t seed)
+{
+  this->seed(seed);
+}
+
+void FastRand::seed(uint32_t seed)
+{
+  mState = seed ? seed : DEFAULT_SEED;  //xorshift never leaves 0 once it gets there.
+  mLast = mState;
+  mAheadFirst = 0;
+  mAheadCount = 0;
+  mPool = 0;
+  mPoolBits = 0;
+}
+
+/*A word of xorshift output is also the state that made it, so where the
+ * caller is up to is the last word it took, however far prefill() has gone.
+ */
+uint32_t FastRand::state()
+{
+  return mLast;
+}
+
+inline uint32_t FastRand::step()
+{
+  uint32_t x = mState;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  mState = x;
+  return x;
+}
+
+inline uint32_t FastRand::next()
+{
+  if (mAheadCount)  //Words made ahead come first, so the sequence is the same either way.
+  {
+    mLast = mAhead[mAheadFirst];
+    mAheadFirst = (mAheadFirst + 1) % AHEAD;
+    --mAheadCount;
+  }
+  else
+  {
+    mLast = step();
+#ifdef HOST_SIM
+    ++Sim::stats.randSteps;
+#endif
+  }
+  return mLast;
+}
+
+/*prefill is for time we'd otherwise spend waiting, like the strip's latch.
+ * Each call is one xorshift step, so it's cheap enough to poll.
+ */
+bool FastRand::prefill()
+{
+  if (mAheadCount == AHEAD)
+  {
+    return false;
+  }
+  mAhead[(mAheadFirst + mAheadCount) % AHEAD] = step();
+  ++mAheadCount;
+  return true;
+}
+
+inline uint32_t FastRand::lanes()
+{
+  return next();
+}
+
+//Hand out bits from the pool, refilling it a word at a time.
+inline uint16_t FastRand::take(byte bits)
+{
+  if (mPoolBits < bits)
+  {
+    mPool = next();
+    mPoolBits = 32;
+  }
+  uint16_t r = (uint16_t)mPool & (uint16_t)((1UL << bits) - 1);
+  mPool >>= bits;
+  mPoolBits -= bits;
+  return r;
+}
+
+/*16 random bits are a number from 0 to 65535.  1 in n of those numbers are
+ * below 65536/n.  The divide is here but it's only once per call, and callers
+ * use this once a frame, not once a pixel.
+ */
+inline bool FastRand::oneIn(uint16_t n)
+{
+  if (n <= 1)
+  {
+    return true;
+  }
+  return take(16) < (uint16_t)(65536UL / n);
+}
+
+//Scale 8 random bits into 0..n-1 with a multiply instead of a modulo.
+inline byte FastRand::below(byte n)
+{
+  return (byte)(((uint16_t)take(8) * n) >> 8);
+}
+
+inline signed char FastRand::trit(byte lane)
+{
+  if (lane < TRIT_DOWN)
+  {
+    return -1;
+  }
+  return lane >= TRIT_UP ? 1 : 0;
+}
+
+inline bool FastRand::drain(byte lane)
+{
+  return lane < DRAIN_ODDS;
+}
+
+#endif //FASTRAND_H
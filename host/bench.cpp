@@ -0,0 +1,202 @@
+/*bench.cpp
+ * Frame-rate benchmark for the host build.  Runs the real sketch (setup() and
+ * loop()) against the stand-ins in shim/ and reports how fast the host gets
+ * through frames along with the counts that matter on the board: SPI
+ * transactions and bytes, random() calls and bits on the wire per frame.
+ *
+ * Host time says nothing absolute about a 16MHz AVR but it moves with the code,
+ * and the counts are exact.  The modelled columns turn the counts into board
+ * time using the bus and strip timing the sketch is built for.
+ *
+ *   bench [frames] [serial.bin]
+ *
+ * With a second argument, whatever the sketch wrote to Serial (the telemetry
+ * records, in a USE_TELEMETRY build) is saved there for teledump.
+ */
+#include <Arduino.h>
+#include <Sim.h>
+#include <stdio.h>
+#include <chrono>
+
+//The Arduino IDE generates prototypes for the sketch; we have to do it by hand.
+void display_pix();
+void setup();
+void loop();
+
+#include "../digital_rain3.ino"
+
+//Board-side costs used for the modelled columns.
+static const double SPI_US_PER_BYTE = 8.0 / 4.0;  //SPI_CLOCK_DIV4 on a 16MHz part is 4MHz.
+static const double SPI_US_PER_TX = 4.0;  //Its two chip selects; digitalWrite is slow.
+static const double WIRE_US_PER_BIT = (T1H + T1L + T0H + T0L) / 2000.0;  //Mean of a 0 and a 1 bit.
+
+int main(int argc, char** argv)
+{
+  long frames = 200;
+  if (argc > 1)
+  {
+    frames = atol(argv[1]);
+  }
+  if (frames < 1)
+  {
+    frames = 1;
+  }
+
+  setup();
+  loop();  //Warm up: the first frame pays for mode switches and allocation.
+
+  Sim::stats.maxGapSpiBytes = 0;
+  Sim::stats.maxCliSlots = 0;
+  Sim::Stats before = Sim::stats;
+  std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+  for (long f = 0; f < frames; ++f)
+  {
+    loop();
+  }
+  std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+  Sim::Stats after = Sim::stats;
+
+  double secs = std::chrono::duration<double>(t1 - t0).count();
+  double n = (double)frames;
+  double spiTx = (after.spiTransactions - before.spiTransactions) / n;
+  double spiBytes = (after.spiBytes - before.spiBytes) / n;
+  double spiWrite = (after.spiWriteBytes - before.spiWriteBytes) / n;
+  double rnd = (after.randomCalls - before.randomCalls) / n;
+  double bits = (after.wireBits - before.wireBits) / n;
+  double slots = (after.wireSlots - before.wireSlots) / n;
+
+  printf("leds          %d\n", (int)CONFIG::NUM_LEDS);
+  printf("pixels        %d\n", (int)CONFIG::NUM_PIX);  //Stored and walked; see PIX_MAP.
+  printf("lanes         %d\n", (int)LED_LANES);
+  printf("frames        %ld\n", frames);
+  printf("host fps      %.1f\n", n / secs);
+  printf("host pix/s    %.0f\n", n * CONFIG::NUM_LEDS / secs);
+  printf("host us/frame %.1f\n", secs * 1e6 / n);
+  printf("spi tx/frame  %.1f\n", spiTx);
+  printf("spi B/frame   %.1f\n", spiBytes);
+  printf("spi wr B/frame %.1f\n", spiWrite);
+  printf("random/frame  %.1f\n", rnd);
+  printf("walk ops/frame %.1f\n", (after.walkOps - before.walkOps) / n);
+  printf("rand steps/frame %.1f\n", (after.randSteps - before.randSteps) / n);
+  printf("wire B/frame  %.1f\n", bits / 8);
+  printf("model spi us  %.0f\n", spiBytes * SPI_US_PER_BYTE + spiTx * SPI_US_PER_TX);
+  printf("model wire us %.0f\n", slots * WIRE_US_PER_BIT);  //Lanes share bit times.
+  printf("max gap spi B %lu (%.0f us)\n", after.maxGapSpiBytes, after.maxGapSpiBytes * SPI_US_PER_BYTE);
+#ifdef STREAM_RENDER
+  const int countedGap = Rain::PIXEL_US;
+#else
+  const int countedGap = EMIT_GAP_US;
+#endif
+  //What the static_asserts hold to the latch.  The SPI bytes alone should never come to more.
+  printf("counted gap us %d%s\n", countedGap,
+         after.maxGapSpiBytes * SPI_US_PER_BYTE > countedGap ? "  UNDER THE MEASURED GAP" : "");
+  printf("max cli us    %.0f\n", after.maxCliSlots * WIRE_US_PER_BIT);  //Longest stretch with interrupts off.
+  printf("early frames  %lu\n", after.earlyFrames - before.earlyFrames);
+  printf("sched missed  %lu of %lu at %d fps\n", sched.missed(), sched.frames(), (int)CONFIG::TARGET_FPS);
+  printf("sched max us  step %lu  latch %lu  emit %lu\n", sched.stageMax(FrameScheduler::STEP),
+         sched.stageMax(FrameScheduler::LATCH), sched.stageMax(FrameScheduler::EMIT));
+
+  /*FNV-1a of the last frame on the wire, so a change in output shows up here.
+   * Only the strip's own bytes count, so a multi-lane build, whose last lane
+   * may be padded, hashes the same as a single lane one.
+   */
+  unsigned long hash = 2166136261UL;
+  const std::vector<byte>& frame = Sim::lastFrame();
+  size_t frameBytes = frame.size();
+  if (frameBytes > (size_t)CONFIG::NUM_LEDS * 3)
+  {
+    frameBytes = (size_t)CONFIG::NUM_LEDS * 3;
+  }
+  for (size_t i = 0; i < frameBytes; ++i)
+  {
+    hash = ((hash ^ frame[i]) * 16777619UL) & 0xFFFFFFFFUL;
+  }
+  printf("frame hash    %08lx\n", hash);
+
+  /*One get() and set() per pixel, in order: the access pattern the SPI cache
+   * window is there for.  Without the cache this is two transactions a pixel.
+   */
+  unsigned long hits = CONFIG::pix.cacheHits();
+  unsigned long misses = CONFIG::pix.cacheMisses();
+  before = Sim::stats;
+  for (int p = 0; p < CONFIG::NUM_PIX; ++p)
+  {
+    CONFIG::pix.set(p, CONFIG::pix.get(p));
+  }
+  CONFIG::pix.flush();
+  after = Sim::stats;
+  printf("sweep spi tx  %lu\n", after.spiTransactions - before.spiTransactions);
+  printf("sweep hit/miss %lu/%lu\n", CONFIG::pix.cacheHits() - hits, CONFIG::pix.cacheMisses() - misses);
+
+#ifdef USE_SPI_MEM
+  printf("spi mem B     %lu in use, high water %lu of %ld in %d bank(s)\n", (unsigned long)spiMem::spi_in_use(),
+         (unsigned long)spiMem::spi_high_water(), MEMSIZE, (int)SPI_BANKS);
+#endif
+
+#ifdef USE_CAPTURE
+  printf("capture       %lu frames, %lu skipped, %lu truncated, %.1f B/frame, serial waited %lu us\n",
+         cap.frames(), cap.skipped(), cap.truncated(), (double)cap.bytes() / (frames + 1), Sim::stats.serialWaitUs);
+#endif
+
+#ifdef USE_SNAPSHOT
+  /*Pull the plug: the pixels are gone, the EEPROM isn't.  Then what setup()
+   * does with it, and what that costs.
+   */
+  printf("snapshots     %u saved of %d pixels, %lu EEPROM B written\n", snap.saved(), Snapshot::PIX,
+         Sim::stats.eepromWrites);
+  COLOR blank[CONFIG::SPAN_PIX];
+  memset(blank, 0, sizeof(blank));
+  for (int first = 0; first < CONFIG::NUM_PIX; first += CONFIG::SPAN_PIX)
+  {
+    CONFIG::pix.setSpan(first, CONFIG::NUM_PIX - first < CONFIG::SPAN_PIX ? CONFIG::NUM_PIX - first : CONFIG::SPAN_PIX, blank);
+  }
+  CONFIG::pix.swap();
+  before = Sim::stats;
+  t0 = std::chrono::steady_clock::now();
+  bool warm = snap.restore(rain);
+  rain.setup();
+  t1 = std::chrono::steady_clock::now();
+  after = Sim::stats;
+  printf("warm start    %s, %lu spi tx, %lu spi B, host us %.1f\n", warm ? "restored" : "no snapshot",
+         after.spiTransactions - before.spiTransactions, after.spiBytes - before.spiBytes,
+         std::chrono::duration<double>(t1 - t0).count() * 1e6);
+#endif
+
+  /*The random draws for one pixel, the way the walk used to make them (an
+   * Arduino random() per sub-pixel: random(3) to walk, random(5) to drain) and
+   * the way it makes them now (one FastRand word, decoded per lane).
+   */
+  const long DRAWS = 1000000;
+  volatile long sink = 0;
+  t0 = std::chrono::steady_clock::now();
+  for (long i = 0; i < DRAWS; ++i)
+  {
+    sink += random(3) + random(3) + !random(5);
+  }
+  t1 = std::chrono::steady_clock::now();
+  double legacyNs = std::chrono::duration<double>(t1 - t0).count() * 1e9 / DRAWS;
+  FastRand fr;
+  t0 = std::chrono::steady_clock::now();
+  for (long i = 0; i < DRAWS; ++i)
+  {
+    uint32_t lanes = fr.lanes();
+    sink += FastRand::trit((byte)lanes) + FastRand::trit((byte)(lanes >> 8)) + FastRand::drain((byte)(lanes >> 16));
+  }
+  t1 = std::chrono::steady_clock::now();
+  double fastNs = std::chrono::duration<double>(t1 - t0).count() * 1e9 / DRAWS;
+  printf("rand ns/pix   random() %.1f  FastRand %.1f\n", legacyNs, fastNs);
+
+  if (argc > 2)
+  {
+    const std::vector<byte>& out = Sim::serialOutput();
+    FILE* f = fopen(argv[2], "wb");
+    if (!f || fwrite(out.data(), 1, out.size(), f) != out.size())
+    {
+      fprintf(stderr, "bench: can't write %s\n", argv[2]);
+      return 1;
+    }
+    fclose(f);
+    printf("serial B      %lu to %s\n", (unsigned long)out.size(), argv[2]);
+  }
+  return 0;
+}
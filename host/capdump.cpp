@@ -0,0 +1,242 @@
+/*capdump.cpp
+ * Rebuilds the frames a USE_CAPTURE build sends over Serial (see capture.h
+ * for the records).  Feed it a capture of the serial port, or what bench
+ * saved, and optionally a file for the frames:
+ *
+ *   capdump serial.bin [frames.bin]
+ *   capdump < /dev/ttyACM0
+ *
+ * frames.bin is every frame in order, 4 bytes a pixel: red, green, blue and
+ * 1 if we know that pixel for sure, 0 if we lost track of it (a frame that
+ * didn't fit, or pixels it left out) and it's still waiting for its refresh.
+ * A pixel we don't know keeps the last value we had for it.  Frames that never
+ * arrived are written too, all unknown, so frame n of the file is frame n on
+ * the wall.
+ *
+ * A frame with a bad sum is thrown away whole and counts as lost.
+ */
+#include <Arduino.h>
+#include <stdio.h>
+#include <vector>
+
+static const byte VERSION = 1;  //capture.h's Capture::VERSION.
+
+struct Frame
+{
+  std::vector<byte> rgb;   //3 bytes a pixel.
+  std::vector<byte> known;
+};
+
+static unsigned int get16(const byte* at)
+{
+  return at[0] | (at[1] << 8);
+}
+
+/*One frame's records from in[i], which is an 'F'.  Returns the bytes it
+ * took, or 0 if it isn't a whole good frame.  Called to check first, then with
+ * apply to put the records into f.  An 'H' sizes f, all unknown, if it
+ * wasn't already that size.
+ */
+static size_t readFrame(const std::vector<byte>& in, size_t i, Frame& f, bool apply, bool& trunc)
+{
+  size_t at = i + 2;
+  byte sum = in[i] + in[i + 1];
+  size_t numPix = f.known.size();
+  trunc = false;
+  while (at < in.size())
+  {
+    byte tag = in[at];
+    size_t len;
+    switch (tag)
+    {
+      case 'H': len = 4; break;
+      case 'D': len = at + 4 <= in.size() ? 4 + (6 * in[at + 3] + 7) / 8 : 4; break;
+      case 'T': len = 5; break;
+      case 'R': len = at + 4 <= in.size() ? 4 + 3 * in[at + 3] : 4; break;
+      case 'E': len = 2; break;
+      default: return 0;
+    }
+    if (at + len > in.size())
+    {
+      return 0;
+    }
+    const byte* rec = &in[at];
+    if (tag == 'E')
+    {
+      return rec[1] == sum ? at + 2 - i : 0;
+    }
+    for (size_t k = 0; k < len; ++k)
+    {
+      sum += rec[k];
+    }
+    if (tag == 'H')
+    {
+      if (rec[1] != VERSION)
+      {
+        return 0;
+      }
+      numPix = get16(rec + 2);
+      if (apply && f.known.size() != numPix)
+      {
+        f.rgb.assign(3 * numPix, 0);
+        f.known.assign(numPix, 0);
+      }
+    }
+    else if (tag == 'D' || tag == 'R')
+    {
+      if (get16(rec + 1) + rec[3] > numPix)
+      {
+        return 0;
+      }
+    }
+    else if (tag == 'T')
+    {
+      trunc = true;
+      if (get16(rec + 3) >= numPix || get16(rec + 1) > get16(rec + 3))
+      {
+        return 0;
+      }
+    }
+    if (!apply)
+    {
+      at += len;
+      continue;
+    }
+    if (tag == 'D')
+    {
+      int first = get16(rec + 1);
+      for (int p = 0; p < rec[3]; ++p)
+      {
+        for (int c = 0; c < 3; ++c)
+        {
+          int bit = 6 * p + 2 * c;
+          byte step = (rec[4 + (bit >> 3)] >> (bit & 7)) & 3;
+          byte& v = f.rgb[3 * (first + p) + c];
+          if (step == 1)
+          {
+            ++v;
+          }
+          else if (step == 2)
+          {
+            --v;
+          }
+          else if (step == 3)
+          {
+            f.known[first + p] = 0;
+          }
+        }
+      }
+    }
+    else if (tag == 'T')
+    {
+      for (unsigned int p = get16(rec + 1); p <= get16(rec + 3); ++p)
+      {
+        f.known[p] = 0;
+      }
+    }
+    else if (tag == 'R')
+    {
+      int first = get16(rec + 1);
+      for (int p = 0; p < rec[3]; ++p)
+      {
+        f.rgb[3 * (first + p)] = rec[4 + 3 * p];
+        f.rgb[3 * (first + p) + 1] = rec[5 + 3 * p];
+        f.rgb[3 * (first + p) + 2] = rec[6 + 3 * p];
+        f.known[first + p] = 1;
+      }
+    }
+    at += len;
+  }
+  return 0;
+}
+
+static void writeFrame(FILE* out, const Frame& f)
+{
+  for (size_t p = 0; p < f.known.size(); ++p)
+  {
+    fwrite(&f.rgb[3 * p], 1, 3, out);
+    fputc(f.known[p], out);
+  }
+}
+
+int main(int argc, char** argv)
+{
+  FILE* f = argc > 1 ? fopen(argv[1], "rb") : stdin;
+  if (!f)
+  {
+    fprintf(stderr, "capdump: can't open %s\n", argv[1]);
+    return 1;
+  }
+  FILE* out = NULL;
+  if (argc > 2 && !(out = fopen(argv[2], "wb")))
+  {
+    fprintf(stderr, "capdump: can't write %s\n", argv[2]);
+    return 1;
+  }
+  std::vector<byte> in;
+  int ch;
+  while ((ch = fgetc(f)) != EOF)
+  {
+    in.push_back((byte)ch);
+  }
+
+  Frame frame;
+  long frames = 0;     //Decoded.
+  long lost = 0;       //Never arrived, or arrived garbled.
+  long truncated = 0;
+  long skipped = 0;    //Bytes that weren't part of a good frame.
+  double knownSum = 0;
+  int expect = -1;     //seq of the next frame.
+  long firstSeq = -1;
+  size_t i = 0;
+  while (i + 2 <= in.size())
+  {
+    bool trunc;
+    size_t len = in[i] == 'F' ? readFrame(in, i, frame, false, trunc) : 0;
+    if (!len)
+    {
+      ++i;
+      ++skipped;
+      continue;
+    }
+    byte seq = in[i + 1];
+    if (expect >= 0 && seq != expect)
+    {
+      //The frames in between changed pixels we never heard about.
+      int gap = (seq - expect) & 0xFF;
+      lost += gap;
+      frame.known.assign(frame.known.size(), 0);
+      for (int g = 0; g < gap && out; ++g)
+      {
+        writeFrame(out, frame);
+      }
+    }
+    readFrame(in, i, frame, true, trunc);  //The first 'H' sizes the frame, all unknown.
+    i += len;
+    if (frame.known.empty())
+    {
+      continue;  //Nothing to put the pixels in until an 'H'.
+    }
+    if (firstSeq < 0)
+    {
+      firstSeq = seq;
+    }
+    expect = (seq + 1) & 0xFF;
+    long known = 0;
+    for (size_t p = 0; p < frame.known.size(); ++p)
+    {
+      known += frame.known[p];
+    }
+    knownSum += (double)known / frame.known.size();
+    truncated += trunc;
+    ++frames;
+    if (out)
+    {
+      writeFrame(out, frame);
+    }
+  }
+  printf("%ld frames from seq %ld, %ld lost, %ld truncated, %ld bytes skipped\n", frames, firstSeq, lost, truncated,
+         skipped + (long)(in.size() - i));
+  printf("%zu pixels, %.1f%% known on average\n", frame.known.size(), frames ? 100.0 * knownSum / frames : 0.0);
+  return 0;
+}
@@ -0,0 +1,351 @@
+/*replay.cpp
+ * Golden frames.  Runs the real sketch against the stand-ins in shim/ on
+ * Sim::modelClock(), so nothing it does depends on how fast the host is, and
+ * keeps every frame that goes out on the wire.  Record a build you trust,
+ * then check any later build of the same variant against it:
+ *
+ *   replay record golden/388 [frames] [seed]
+ *   replay check golden/388 [host slack %]
+ *
+ * record writes golden/388.hashes, a 64 bit FNV-1a hash of each frame's GRB
+ * bytes, and golden/388.time, what the run cost: the counts bench reports and
+ * host time.  Those two are small and go in git, so a fresh clone checks
+ * against a known good run rather than one recorded from the tree being
+ * checked.  It also writes golden/388.frames, every frame's bytes, which
+ * doesn't go in git; where it's there, check uses it to say which LED of a
+ * bad frame first differs.
+ *
+ * check runs as many frames with the same seed and says which frame first
+ * differs, if any.  It fails too if any count went up, so the same run is a
+ * performance check: the counts and the model clock come out the same on any
+ * host, every time.  The model clock only knows delays, the wire and SPI, so
+ * two counts stand in for compute: the walk's channel steps (the SWAR walk
+ * does a pixel's three as one) and the random words made while the walk waits
+ * for them (FastRand's prefill makes the rest while the strip latches).
+ *
+ * Host time is the median of the frames', and it still wanders with whatever
+ * else the host is doing, so it's only checked when asked: with a host slack
+ * of 50, a host time more than 50% over the golden one fails.  Only use it
+ * against goldens recorded on the same machine.  seed 0 (the default) leaves
+ * the rain's own; any other goes to Rain::seed() after setup().
+ */
+#include <Arduino.h>
+#include <Sim.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+//The Arduino IDE generates prototypes for the sketch; we have to do it by hand.
+void display_pix();
+void setup();
+void loop();
+
+#include "../digital_rain3.ino"
+
+//What a run cost.  The counts are exact; host time moves with the machine, so it's only checked on request.
+struct Cost
+{
+  double hostUs;   //Median per frame.
+  double spiTx;    //The rest are per frame, over the run.
+  double spiBytes;
+  double random;
+  double wireSlots;
+  double modelUs;
+  double walkOps;
+  double randSteps;
+  unsigned long missed;
+};
+
+static const int COSTS = 9;
+static const char* const COST_NAMES[COSTS] = {"host us/frame", "spi tx/frame", "spi B/frame", "random/frame",
+                                              "wire slots/frame", "model us/frame", "walk ops/frame",
+                                              "rand steps/frame", "sched missed"};
+
+static void costValues(const Cost& c, double* v)
+{
+  v[0] = c.hostUs;
+  v[1] = c.spiTx;
+  v[2] = c.spiBytes;
+  v[3] = c.random;
+  v[4] = c.wireSlots;
+  v[5] = c.modelUs;
+  v[6] = c.walkOps;
+  v[7] = c.randSteps;
+  v[8] = c.missed;
+}
+
+//64 bit FNV-1a: small, and plenty to tell two frames apart.
+static unsigned long long frameHash(const std::vector<byte>& frame)
+{
+  unsigned long long h = 14695981039346656037ULL;
+  for (size_t i = 0; i < frame.size(); ++i)
+  {
+    h = (h ^ frame[i]) * 1099511628211ULL;
+  }
+  return h;
+}
+
+/*Runs the sketch for frames frames and calls keep(f, bytes) with each one as
+ * it stands on the wire after loop() f: the strip's NUM_LEDS*3 bytes, black
+ * where nothing has gone out yet.
+ */
+template <class Keep>
+static Cost run(long frames, unsigned long seed, Keep& keep)
+{
+  Sim::modelClock();
+  setup();
+  if (seed)
+  {
+    rain.seed(seed);
+  }
+
+  std::vector<byte> frame(CONFIG::NUM_LEDS * 3);
+  std::vector<double> hostUs;
+  Sim::Stats before = Sim::stats;
+  unsigned long missed = sched.missed();
+  unsigned long model = micros();
+  for (long f = 0; f < frames; ++f)
+  {
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    loop();
+    std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+    hostUs.push_back(std::chrono::duration<double>(t1 - t0).count() * 1e6);
+    const std::vector<byte>& wire = Sim::lastFrame();
+    size_t n = std::min(wire.size(), frame.size());
+    std::copy(wire.begin(), wire.begin() + n, frame.begin());
+    std::fill(frame.begin() + n, frame.end(), 0);
+    keep(f, frame);
+  }
+  Sim::Stats after = Sim::stats;
+
+  Cost c;
+  std::nth_element(hostUs.begin(), hostUs.begin() + hostUs.size() / 2, hostUs.end());
+  c.hostUs = hostUs[hostUs.size() / 2];
+  c.spiTx = (double)(after.spiTransactions - before.spiTransactions) / frames;
+  c.spiBytes = (double)(after.spiBytes - before.spiBytes) / frames;
+  c.random = (double)(after.randomCalls - before.randomCalls) / frames;
+  c.wireSlots = (double)(after.wireSlots - before.wireSlots) / frames;
+  c.modelUs = (double)(micros() - model) / frames;
+  c.walkOps = (double)(after.walkOps - before.walkOps) / frames;
+  c.randSteps = (double)(after.randSteps - before.randSteps) / frames;
+  c.missed = sched.missed() - missed;
+  return c;
+}
+
+struct Recorder
+{
+  FILE* hashes;
+  FILE* frames;
+  void operator()(long, const std::vector<byte>& frame)
+  {
+    fprintf(hashes, "%016llx\n", frameHash(frame));
+    fwrite(frame.data(), 1, frame.size(), frames);
+  }
+};
+
+/*Checks each frame's hash against the golden one and remembers the first
+ * that differs, and where in it if the golden frames are here too.
+ */
+struct Checker
+{
+  FILE* hashes;
+  FILE* frames;  //NULL if there are none.
+  long badFrame;
+  long badLed;   //-1 if unknown.
+  bool ended;    //The golden run ran out of frames.
+  std::vector<byte> want;
+  std::vector<byte> got;
+  void operator()(long f, const std::vector<byte>& frame)
+  {
+    want.resize(frame.size());
+    bool haveFrame = frames && fread(want.data(), 1, want.size(), frames) == want.size();
+    if (badFrame >= 0)
+    {
+      return;
+    }
+    unsigned long long wantHash;
+    if (fscanf(hashes, "%llx", &wantHash) != 1)
+    {
+      badFrame = f;
+      ended = true;
+      return;
+    }
+    if (frameHash(frame) == wantHash)
+    {
+      return;
+    }
+    badFrame = f;
+    badLed = -1;
+    got = frame;
+    for (size_t i = 0; haveFrame && i < frame.size(); ++i)
+    {
+      if (frame[i] != want[i])
+      {
+        badLed = i / 3;
+        break;
+      }
+    }
+  }
+};
+
+static std::string path(const char* base, const char* ext)
+{
+  return std::string(base) + ext;
+}
+
+static int record(const char* base, long frames, unsigned long seed)
+{
+  std::string hashesPath = path(base, ".hashes");
+  std::string framesPath = path(base, ".frames");
+  std::string timePath = path(base, ".time");
+  Recorder rec;
+  rec.hashes = fopen(hashesPath.c_str(), "w");
+  rec.frames = fopen(framesPath.c_str(), "wb");
+  if (!rec.hashes || !rec.frames)
+  {
+    fprintf(stderr, "replay: can't write %s\n", (rec.hashes ? framesPath : hashesPath).c_str());
+    return 1;
+  }
+  Cost c = run(frames, seed, rec);
+  fclose(rec.hashes);
+  fclose(rec.frames);
+
+  FILE* t = fopen(timePath.c_str(), "w");
+  if (!t)
+  {
+    fprintf(stderr, "replay: can't write %s\n", timePath.c_str());
+    return 1;
+  }
+  double v[COSTS];
+  costValues(c, v);
+  fprintf(t, "frames %ld\nseed %lu\nleds %d\n", frames, seed, (int)CONFIG::NUM_LEDS);
+  for (int k = 0; k < COSTS; ++k)
+  {
+    fprintf(t, "%s %.3f\n", COST_NAMES[k], v[k]);
+  }
+  fclose(t);
+  printf("%s: %ld frames of %d LEDs, %.1f host us/frame\n", base, frames, (int)CONFIG::NUM_LEDS, c.hostUs);
+  return 0;
+}
+
+//hostSlack below 0 leaves host time unchecked.
+static int check(const char* base, double hostSlack)
+{
+  std::string hashesPath = path(base, ".hashes");
+  std::string framesPath = path(base, ".frames");
+  std::string timePath = path(base, ".time");
+  FILE* t = fopen(timePath.c_str(), "r");
+  Checker chk;
+  chk.hashes = fopen(hashesPath.c_str(), "r");
+  if (!t || !chk.hashes)
+  {
+    fprintf(stderr, "replay: no golden run at %s (replay record it first)\n", base);
+    return 1;
+  }
+  chk.frames = fopen(framesPath.c_str(), "rb");
+  long frames = 0;
+  unsigned long seed = 0;
+  int leds = 0;
+  double golden[COSTS] = {0};
+  bool have[COSTS] = {false};
+  char line[80];
+  while (fgets(line, sizeof(line), t))
+  {
+    sscanf(line, "frames %ld", &frames);
+    sscanf(line, "seed %lu", &seed);
+    sscanf(line, "leds %d", &leds);
+    for (int k = 0; k < COSTS; ++k)
+    {
+      size_t len = strlen(COST_NAMES[k]);
+      if (!strncmp(line, COST_NAMES[k], len) && line[len] == ' ')
+      {
+        golden[k] = atof(line + len + 1);
+        have[k] = true;
+      }
+    }
+  }
+  fclose(t);
+  if (frames < 1 || leds != CONFIG::NUM_LEDS)
+  {
+    fprintf(stderr, "replay: %s is %d LEDs, this build is %d\n", base, leds, (int)CONFIG::NUM_LEDS);
+    return 1;
+  }
+
+  chk.badFrame = -1;
+  chk.badLed = -1;
+  chk.ended = false;
+  Cost c = run(frames, seed, chk);
+  fclose(chk.hashes);
+  if (chk.frames)
+  {
+    fclose(chk.frames);
+  }
+
+  bool ok = chk.badFrame < 0;
+  if (ok)
+  {
+    printf("%s: %ld frames match\n", base, frames);
+  }
+  else if (chk.ended)
+  {
+    printf("%s: golden frames end at frame %ld\n", base, chk.badFrame);
+  }
+  else if (chk.badLed < 0)
+  {
+    printf("%s: frame %ld differs (no golden .frames here to say where)\n", base, chk.badFrame);
+  }
+  else
+  {
+    const byte* g = &chk.got[3 * chk.badLed];
+    const byte* w = &chk.want[3 * chk.badLed];
+    printf("%s: frame %ld differs, first at LED %ld: GRB %d,%d,%d, golden %d,%d,%d\n", base, chk.badFrame,
+           chk.badLed, g[0], g[1], g[2], w[0], w[1], w[2]);
+  }
+
+  //A count that goes up at all is a real change.  Host time has its slack, if it's checked at all.
+  double v[COSTS];
+  costValues(c, v);
+  for (int k = 0; k < COSTS; ++k)
+  {
+    bool worse;
+    const char* note = "";
+    if (!have[k])
+    {
+      worse = true;
+      note = "  NOT IN GOLDEN";
+    }
+    else if (k == 0)
+    {
+      worse = hostSlack >= 0 && v[k] > golden[k] * (1 + hostSlack / 100);
+      note = hostSlack < 0 ? "  (not checked)" : "";
+    }
+    else
+    {
+      worse = v[k] > golden[k] + 0.0005;
+    }
+    printf("  %-17s %10.1f  golden %10.1f  %+6.1f%%%s\n", COST_NAMES[k], v[k], golden[k],
+           golden[k] ? 100 * (v[k] - golden[k]) / golden[k] : 0.0, worse && have[k] ? "  WORSE" : note);
+    ok = ok && !worse;
+  }
+  return ok ? 0 : 1;
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 3 || (strcmp(argv[1], "record") && strcmp(argv[1], "check")))
+  {
+    fprintf(stderr, "usage: replay record <golden> [frames] [seed]\n"
+                    "       replay check <golden> [host slack %%]\n");
+    return 2;
+  }
+  if (!strcmp(argv[1], "record"))
+  {
+    long frames = argc > 3 ? atol(argv[3]) : 100;
+    unsigned long seed = argc > 4 ? strtoul(argv[4], NULL, 0) : 0;
+    return record(argv[2], frames < 1 ? 1 : frames, seed);
+  }
+  return check(argv[2], argc > 3 ? atof(argv[3]) : -1);
+}
@@ -0,0 +1,70 @@
+/*Arduino.h  (host stand-in)
+ * Just enough of the Arduino core for the sketch to compile and run on a
+ * desktop machine.  The sketch never knows the difference: the same headers
+ * that go to the board are compiled here with HOST_SIM defined.
+ *
+ * random() is a faithful copy of the avr-libc generator Arduino sits on, so a
+ * host run draws exactly the same numbers the board would.
+ */
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifndef F_CPU
+#define F_CPU 16000000L   //The Uno's clock.  Timing macros in litepixel.h use it.
+#endif
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH 0x1
+#define LOW  0x0
+#define INPUT  0x0
+#define OUTPUT 0x1
+
+#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
+#define bitSet(value, bit) ((value) |= (1UL << (bit)))
+#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
+
+//Flash is just more memory here.
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t*)(addr))
+
+//Port registers.  Writes land in plain variables so bitSet() on them is harmless.
+extern volatile uint8_t PORTD;
+extern volatile uint8_t DDRD;
+
+//Interrupts do not exist here, but we count how often the sketch masks them.
+void cli();
+void sei();
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+//Arduino's random(n) is avr-libc random() % n.  Note: overloads, not the libc random(void).
+long random(long howbig);
+long random(long howsmall, long howbig);
+void randomSeed(unsigned long seed);
+
+class HardwareSerial
+{
+public:
+  void begin(unsigned long baud);
+  size_t write(uint8_t b);
+  size_t write(const uint8_t* buf, size_t len);
+  int availableForWrite();
+  int available();
+  int read();
+};
+extern HardwareSerial Serial;
+
+#endif //HOST_ARDUINO_H
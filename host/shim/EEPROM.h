@@ -0,0 +1,25 @@
+/*EEPROM.h  (host stand-in)
+ * The Uno's 1K of EEPROM.  It starts erased (every byte 0xFF) and, like the
+ * real thing, Sim::reset() leaves it alone: it's what survives a power cycle.
+ * A write keeps the EEPROM busy for 3.3ms of micros() time, as the board's
+ * does, and eeprom_is_ready() says when it's done.
+ */
+#ifndef HOST_EEPROM_H
+#define HOST_EEPROM_H
+
+#include <Arduino.h>
+
+class EEPROMClass
+{
+public:
+  uint8_t read(int idx);
+  void write(int idx, uint8_t val);   //Waits out a write still in progress first.
+  void update(int idx, uint8_t val);  //Only writes if the byte is different.
+  uint16_t length();
+};
+extern EEPROMClass EEPROM;
+
+//From avr/eeprom.h, which the real EEPROM.h includes.
+bool eeprom_is_ready();
+
+#endif //HOST_EEPROM_H
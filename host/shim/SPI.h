@@ -0,0 +1,34 @@
+/*SPI.h  (host stand-in)
+ * The bus is modelled one byte at a time.  Whatever device has its chip select
+ * pulled low answers transfer(); see sim.cpp for the 23K256 model.
+ */
+#ifndef HOST_SPI_H
+#define HOST_SPI_H
+
+#include <Arduino.h>
+
+#define SPI_CLOCK_DIV4 0x00
+#define SPI_CLOCK_DIV16 0x01
+#define SPI_CLOCK_DIV64 0x02
+#define SPI_CLOCK_DIV128 0x03
+#define SPI_CLOCK_DIV2 0x04
+#define SPI_CLOCK_DIV8 0x05
+#define SPI_CLOCK_DIV32 0x06
+
+#define SPI_MODE0 0x00
+
+#define MSBFIRST 1
+
+class SPIClass
+{
+public:
+  void begin();
+  void end();
+  void setClockDivider(uint8_t div);
+  void setDataMode(uint8_t mode);
+  void setBitOrder(uint8_t order);
+  byte transfer(byte data);
+};
+extern SPIClass SPI;
+
+#endif //HOST_SPI_H
@@ -0,0 +1,75 @@
+/*Sim.h
+ * The host side of the simulation: the wire LitePixel talks to and the
+ * counters every stand-in bumps.  Only the host build ever includes this.
+ */
+#ifndef HOST_SIM_H
+#define HOST_SIM_H
+
+#include <Arduino.h>
+#include <vector>
+
+namespace Sim
+{
+  //Running totals.  The bench snapshots these around a batch of frames.
+  struct Stats
+  {
+    unsigned long spiTransactions;  //Chip-select assertions on any SPI device.
+    unsigned long spiBytes;         //Bytes clocked over the SPI bus.
+    unsigned long spiWriteBytes;    //Data bytes written into SPI RAM.
+    unsigned long randomCalls;      //Calls to Arduino random().
+    unsigned long cliCalls;         //Times interrupts were masked.
+    unsigned long maxCliSlots;      //Longest they stayed masked, in wire bit times.
+    unsigned long wireBits;         //Bits sent to the LED strip, all lanes together.
+    unsigned long wireSlots;        //Bit times on the wire; lanes share a slot.
+    unsigned long frames;           //Latches seen on the LED strip.
+    unsigned long maxGapSpiBytes;   //Most SPI bytes between two bits of one frame.
+    unsigned long earlyFrames;      //Frames started before the last one finished latching.
+    unsigned long eepromWrites;     //Bytes written to EEPROM (update() skips unchanged ones).
+    unsigned long serialWaitUs;     //Time Serial.write() spent waiting for room.
+    /*What the walk computed, for a check on compute that's the same on any
+     * host.  Bumped by the sketch itself (HOST_SIM builds only).
+     */
+    unsigned long walkOps;          //Channel steps the rain walk worked out; SWAR does a pixel's three as one.
+    unsigned long randSteps;        //xorshift steps FastRand made while the walk waited, not ahead in prefill().
+  };
+  extern Stats stats;
+
+  //LitePixel hooks.  Bits are assembled MSB first into the current frame.
+  void wireBit(bool val);
+  void wireLanes(byte bits, byte lanes);  //One bit on each lane: bit k is lane k's.
+  void wireLatch(unsigned int holdUs);  //Line held low holdUs from now.
+
+  /*The last complete frame as it went out on the wire (GRB order).  With
+   * several lanes it is lane 0's bytes, then lane 1's and so on, which is the
+   * strip in order followed by whatever padding the last lane was sent.
+   */
+  const std::vector<byte>& lastFrame();
+
+  //Everything the sketch has written to Serial so far.
+  const std::vector<byte>& serialOutput();
+
+  /*Puts a RAM chip of size bytes, taking addrBytes address bytes, on the given
+   * chip-select pin, or replaces the one there.  spi_mem.h calls it for each
+   * bank it has.
+   */
+  void spiRamChip(uint8_t pin, unsigned long size, byte addrBytes);
+
+  //Memory of the SPI RAM chip on the given chip-select pin, for inspection.
+  byte* spiRamImage(uint8_t pin);
+  unsigned long spiRamSize(uint8_t pin);
+
+  //The EEPROM's bytes, for inspection.  Sim::reset() leaves them be.
+  byte* eepromImage();
+
+  /*From now on micros() is board time as the stand-ins model it and nothing
+   * else: delays, bits on the LED wire and 2us an SPI byte.  The host's own
+   * clock is left out, so a run is the same every time.  Call it before
+   * setup().
+   */
+  void modelClock();
+
+  //Puts every stand-in back to its power-on state: clears RAM, counters, seed.
+  void reset();
+};
+
+#endif //HOST_SIM_H
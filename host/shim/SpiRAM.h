@@ -0,0 +1,44 @@
+/*SpiRAM.h  (host stand-in)
+ * Same interface as the SpiRAM library the sketch links on the board.  The
+ * implementation in sim.cpp follows the library: it sets the chip mode over
+ * WRSR and then clocks the READ/WRITE command, address and data through SPI.
+ */
+#ifndef HOST_SPIRAM_H
+#define HOST_SPIRAM_H
+
+#include <Arduino.h>
+#include <SPI.h>
+
+// SRAM opcodes
+#define RDSR 5
+#define WRSR 1
+#define READ 3
+#define WRITE 2
+
+// SRAM Hold line override
+#define HOLD 1
+
+// SRAM modes
+#define BYTE_MODE (0x00 | HOLD)
+#define PAGE_MODE (0x80 | HOLD)
+#define STREAM_MODE (0x40 | HOLD)
+
+class SpiRAM
+{
+  public:
+    SpiRAM(byte clock, byte ssPin);
+    void enable();
+    void disable();
+    char read_byte(int address);
+    char write_byte(int address, char data_byte);
+    void read_page(int address, char *buffer);
+    void write_page(int address, char *buffer);
+    void read_stream(int address, char *buffer, int length);
+    void write_stream(int address, char *buffer, int length);
+  private:
+    char _current_mode;
+    byte _ss_Pin;
+    void _set_mode(char mode);
+};
+
+#endif //HOST_SPIRAM_H
@@ -0,0 +1,714 @@
+/*sim.cpp
+ * Host implementations of the Arduino core, the SPI bus with the 23K256 RAM
+ * chip hanging off it, the SpiRAM library, the EEPROM and the LED wire.
+ */
+#include <Arduino.h>
+#include <SPI.h>
+#include <SpiRAM.h>
+#include <EEPROM.h>
+#include <Sim.h>
+
+#include <chrono>
+#include <vector>
+
+volatile uint8_t PORTD;
+volatile uint8_t DDRD;
+HardwareSerial Serial;
+SPIClass SPI;
+
+namespace Sim
+{
+  Stats stats;
+}
+
+/*---------------------------------------------------------------------------
+ * Time.  micros() is the host clock plus whatever the sketch asked to sleep,
+ * so delays cost nothing on the host but still move time forward.  Bits on
+ * the LED wire move it forward too, by what they take on the board, so a
+ * wait that a frame's worth of sending covers on the board is covered here.
+ */
+static std::chrono::steady_clock::time_point sStart = std::chrono::steady_clock::now();
+static unsigned long sSlept = 0;
+static unsigned long sWireNs = 0;  //Wire time not yet a whole microsecond.
+static const unsigned long WIRE_NS_PER_SLOT = 1400;  //Mean of a 0 and a 1 bit at litepixel.h's timings.
+static bool sModelClock = false;   //Leave the host clock out; see Sim::modelClock().
+static const unsigned long SPI_US_PER_BYTE = 2;  //SPI_CLOCK_DIV4 on a 16MHz part is 4MHz.
+
+unsigned long micros()
+{
+  if (sModelClock)
+  {
+    return sSlept;
+  }
+  std::chrono::steady_clock::duration d = std::chrono::steady_clock::now() - sStart;
+  return (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(d).count() + sSlept;
+}
+
+unsigned long millis()
+{
+  return micros() / 1000;
+}
+
+void delay(unsigned long ms)
+{
+  sSlept += ms * 1000;
+}
+
+void delayMicroseconds(unsigned int us)
+{
+  sSlept += us;
+}
+
+/*Everything the sketch decides from micros() (how many pixels the step has
+ * time for, whether the latch is done, how long to wait for the next frame)
+ * then comes out the same every run, and the same as on any other machine.
+ */
+void Sim::modelClock()
+{
+  sModelClock = true;
+}
+
+/*Interrupts are modelled only as far as how long they stay off, counted in
+ * bit times on the LED wire (which is what keeps them off that long).
+ */
+static bool sMasked = false;
+static unsigned long sMaskedAt = 0;  //stats.wireSlots at cli().
+
+void cli()
+{
+  ++Sim::stats.cliCalls;
+  if (!sMasked)
+  {
+    sMasked = true;
+    sMaskedAt = Sim::stats.wireSlots;
+  }
+}
+
+void sei()
+{
+  if (sMasked && Sim::stats.wireSlots - sMaskedAt > Sim::stats.maxCliSlots)
+  {
+    Sim::stats.maxCliSlots = Sim::stats.wireSlots - sMaskedAt;
+  }
+  sMasked = false;
+}
+
+/*---------------------------------------------------------------------------
+ * random().  A copy of avr-libc's do_random() (Park-Miller minimal standard,
+ * Schrage's method) and of Arduino's WMath wrappers around it.
+ */
+static unsigned long sNext = 1;
+
+static long do_random(unsigned long* ctx)
+{
+  long hi, lo, x;
+
+  x = (long)*ctx;
+  if (x == 0)
+  {
+    x = 123459876L;
+  }
+  hi = x / 127773L;
+  lo = x % 127773L;
+  x = 16807L * lo - 2836L * hi;
+  if (x < 0)
+  {
+    x += 0x7fffffffL;
+  }
+  return ((*ctx = x) % ((unsigned long)0x7fffffffL + 1));
+}
+
+long random(long howbig)
+{
+  ++Sim::stats.randomCalls;
+  if (howbig == 0)
+  {
+    return 0;
+  }
+  return do_random(&sNext) % howbig;
+}
+
+long random(long howsmall, long howbig)
+{
+  if (howsmall >= howbig)
+  {
+    return howsmall;
+  }
+  return random(howbig - howsmall) + howsmall;
+}
+
+void randomSeed(unsigned long seed)
+{
+  if (seed != 0)
+  {
+    sNext = seed;
+  }
+}
+
+/*---------------------------------------------------------------------------
+ * EEPROM.  Kept across Sim::reset(), as it is across a power cycle.
+ */
+static const int EEPROM_BYTES = 1024;
+static const unsigned long EEPROM_WRITE_US = 3300;  //Erase and write, from the datasheet.
+static std::vector<byte>& eeprom()
+{
+  static std::vector<byte> sEeprom(EEPROM_BYTES, 0xFF);
+  return sEeprom;
+}
+static unsigned long sEepromBusyAt = 0;  //micros() at the last write.
+static bool sEepromBusy = false;
+
+EEPROMClass EEPROM;
+
+bool eeprom_is_ready()
+{
+  if (sEepromBusy && micros() - sEepromBusyAt >= EEPROM_WRITE_US)
+  {
+    sEepromBusy = false;
+  }
+  return !sEepromBusy;
+}
+
+uint8_t EEPROMClass::read(int idx)
+{
+  return eeprom()[idx % EEPROM_BYTES];
+}
+
+void EEPROMClass::write(int idx, uint8_t val)
+{
+  if (!eeprom_is_ready())  //avr-libc spins until the last write is done.
+  {
+    delayMicroseconds(EEPROM_WRITE_US - (micros() - sEepromBusyAt));
+  }
+  eeprom()[idx % EEPROM_BYTES] = val;
+  ++Sim::stats.eepromWrites;
+  sEepromBusy = true;
+  sEepromBusyAt = micros();
+}
+
+void EEPROMClass::update(int idx, uint8_t val)
+{
+  if (read(idx) != val)
+  {
+    write(idx, val);
+  }
+}
+
+uint16_t EEPROMClass::length()
+{
+  return EEPROM_BYTES;
+}
+
+byte* Sim::eepromImage()
+{
+  return &eeprom()[0];
+}
+
+/*---------------------------------------------------------------------------
+ * Serial.  Output is kept for Sim::serialOutput(), up to a limit so a long
+ * run can't eat the machine; nothing ever arrives.  The transmit buffer is the
+ * Uno's 64 bytes and empties at the baud rate (10 bits a byte) in micros()
+ * time.  A write with no room waits, as the real one does, and the wait is
+ * counted.
+ */
+static std::vector<byte> sSerialOut;
+static const size_t SERIAL_OUT_MAX = 1 << 20;
+static const int SERIAL_TX_BYTES = 64;
+static unsigned long sBaud = 0;      //0 until begin(): no limit.
+static double sTxQueued = 0;         //Bytes in the transmit buffer at sTxAt.
+static unsigned long sTxAt = 0;
+
+//Let the transmit buffer empty for the time since we last looked.
+static void serialDrain()
+{
+  unsigned long now = micros();
+  sTxQueued -= (now - sTxAt) * (sBaud / 10.0) / 1e6;
+  if (sTxQueued < 0)
+  {
+    sTxQueued = 0;
+  }
+  sTxAt = now;
+}
+
+void HardwareSerial::begin(unsigned long baud)
+{
+  sBaud = baud;
+  sTxQueued = 0;
+  sTxAt = micros();
+}
+
+size_t HardwareSerial::write(uint8_t b)
+{
+  return write(&b, 1);
+}
+
+size_t HardwareSerial::write(const uint8_t* buf, size_t len)
+{
+  if (sSerialOut.size() + len <= SERIAL_OUT_MAX)
+  {
+    sSerialOut.insert(sSerialOut.end(), buf, buf + len);
+  }
+  if (sBaud)
+  {
+    serialDrain();
+    double over = sTxQueued + len - (SERIAL_TX_BYTES - 1);
+    if (over > 0.001)  //Not a rounding error on what availableForWrite() said.
+    {
+      unsigned long us = (unsigned long)(over * 10e6 / sBaud) + 1;
+      Sim::stats.serialWaitUs += us;
+      delayMicroseconds(us);
+      serialDrain();
+    }
+    sTxQueued += len;
+  }
+  return len;
+}
+
+//What the core returns: free space in the transmit buffer, which holds one less than its size.
+int HardwareSerial::availableForWrite()
+{
+  if (!sBaud)
+  {
+    return SERIAL_TX_BYTES - 1;
+  }
+  serialDrain();
+  return SERIAL_TX_BYTES - 1 - (int)(sTxQueued + 0.999);
+}
+
+int HardwareSerial::available()
+{
+  return 0;
+}
+
+int HardwareSerial::read()
+{
+  return -1;
+}
+
+/*---------------------------------------------------------------------------
+ * SPI bus and RAM chips.  A chip listens while its chip select is low and
+ * decodes the 23x256 command set: READ/WRITE with a 16-bit address (24 on
+ * the bigger 23LC1024), RDSR/WRSR
+ * for the mode register.  Byte mode stops after one byte, page mode wraps in
+ * 32 bytes and sequential (stream) mode runs across the whole array.
+ */
+struct SpiRamChip
+{
+  uint8_t pin;
+  unsigned long size;
+  byte addrBytes;
+  std::vector<byte> mem;
+
+  bool selected;
+  byte status;
+  byte cmd;
+  byte phase;        //Bytes seen since chip select, command byte included.
+  unsigned long addr;
+  bool done;         //Byte mode transfer finished, chip ignores the rest.
+};
+
+/*One 23K256 on pin 10 until the sketch says otherwise with spiRamChip().  A
+ * function's static so it's there whenever the first global's constructor
+ * wants it.
+ */
+static std::vector<SpiRamChip>& chips()
+{
+  static std::vector<SpiRamChip> sChips(1, SpiRamChip{ 10, 32768, 2 });
+  return sChips;
+}
+
+static SpiRamChip* chipOn(uint8_t pin)
+{
+  std::vector<SpiRamChip>& all = chips();
+  for (size_t i = 0; i < all.size(); ++i)
+  {
+    if (all[i].pin == pin)
+    {
+      return &all[i];
+    }
+  }
+  return NULL;
+}
+
+void Sim::spiRamChip(uint8_t pin, unsigned long size, byte addrBytes)
+{
+  SpiRamChip* c = chipOn(pin);
+  if (!c)
+  {
+    chips().push_back(SpiRamChip());
+    c = &chips().back();
+  }
+  *c = SpiRamChip();
+  c->pin = pin;
+  c->size = size;
+  c->addrBytes = addrBytes;
+}
+
+static void chipAdvance(SpiRamChip& c)
+{
+  byte mode = c.status & 0xC0;
+  if (mode == (BYTE_MODE & 0xC0))
+  {
+    c.done = true;
+  }
+  else if (mode == (PAGE_MODE & 0xC0))
+  {
+    c.addr = (c.addr & ~31UL) | ((c.addr + 1) & 31UL);
+  }
+  else
+  {
+    c.addr = (c.addr + 1) % c.size;
+  }
+}
+
+static byte chipTransfer(SpiRamChip& c, byte in)
+{
+  byte out = 0xFF;
+  if (c.phase == 0)
+  {
+    c.cmd = in;
+    c.addr = 0;
+  }
+  else if (c.cmd == RDSR)
+  {
+    out = c.status;
+  }
+  else if (c.cmd == WRSR)
+  {
+    if (c.phase == 1)
+    {
+      c.status = in;
+    }
+  }
+  else if (c.cmd == READ || c.cmd == WRITE)
+  {
+    if (c.phase <= c.addrBytes)
+    {
+      c.addr = ((c.addr << 8) | in) % c.size;
+    }
+    else if (!c.done)
+    {
+      if (c.cmd == READ)
+      {
+        out = c.mem[c.addr];
+      }
+      else
+      {
+        c.mem[c.addr] = in;
+        ++Sim::stats.spiWriteBytes;
+      }
+      chipAdvance(c);
+    }
+  }
+  if (c.phase < 255)
+  {
+    ++c.phase;
+  }
+  return out;
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+  SpiRamChip* c = chipOn(pin);
+  if (!c)
+  {
+    return;
+  }
+  if (c->mem.empty())
+  {
+    c->mem.assign(c->size, 0);
+  }
+  bool select = (val == LOW);
+  if (select && !c->selected)
+  {
+    ++Sim::stats.spiTransactions;
+    c->phase = 0;
+    c->done = false;
+  }
+  c->selected = select;
+}
+
+void SPIClass::begin()
+{
+}
+
+void SPIClass::end()
+{
+}
+
+void SPIClass::setClockDivider(uint8_t div)
+{
+}
+
+void SPIClass::setDataMode(uint8_t mode)
+{
+}
+
+void SPIClass::setBitOrder(uint8_t order)
+{
+}
+
+byte SPIClass::transfer(byte data)
+{
+  ++Sim::stats.spiBytes;
+  if (sModelClock)
+  {
+    sSlept += SPI_US_PER_BYTE;
+  }
+  byte out = 0xFF;
+  std::vector<SpiRamChip>& all = chips();
+  for (size_t i = 0; i < all.size(); ++i)
+  {
+    if (all[i].selected)
+    {
+      out = chipTransfer(all[i], data);
+    }
+  }
+  return out;
+}
+
+/*---------------------------------------------------------------------------
+ * The SpiRAM library, as it drives the chip on the board.
+ */
+SpiRAM::SpiRAM(byte clock, byte ssPin)
+{
+  _ss_Pin = ssPin;
+  pinMode(_ss_Pin, OUTPUT);
+  disable();
+  SPI.begin();
+  SPI.setClockDivider(clock);
+  _current_mode = BYTE_MODE;
+}
+
+void SpiRAM::enable()
+{
+  digitalWrite(_ss_Pin, LOW);
+}
+
+void SpiRAM::disable()
+{
+  digitalWrite(_ss_Pin, HIGH);
+}
+
+void SpiRAM::_set_mode(char mode)
+{
+  if (mode != _current_mode)
+  {
+    enable();
+    SPI.transfer(WRSR);
+    SPI.transfer(mode);
+    disable();
+    _current_mode = mode;
+  }
+}
+
+char SpiRAM::read_byte(int address)
+{
+  char data_byte;
+  _set_mode(BYTE_MODE);
+  enable();
+  SPI.transfer(READ);
+  SPI.transfer((char)(address >> 8));
+  SPI.transfer((char)address);
+  data_byte = SPI.transfer(0xFF);
+  disable();
+  return data_byte;
+}
+
+char SpiRAM::write_byte(int address, char data_byte)
+{
+  _set_mode(BYTE_MODE);
+  enable();
+  SPI.transfer(WRITE);
+  SPI.transfer((char)(address >> 8));
+  SPI.transfer((char)address);
+  SPI.transfer(data_byte);
+  disable();
+  return data_byte;
+}
+
+void SpiRAM::read_page(int address, char *buffer)
+{
+  _set_mode(PAGE_MODE);
+  enable();
+  SPI.transfer(READ);
+  SPI.transfer((char)(address >> 8));
+  SPI.transfer((char)address);
+  for (int i = 0; i < 32; i++)
+  {
+    buffer[i] = SPI.transfer(0xFF);
+  }
+  disable();
+}
+
+void SpiRAM::write_page(int address, char *buffer)
+{
+  _set_mode(PAGE_MODE);
+  enable();
+  SPI.transfer(WRITE);
+  SPI.transfer((char)(address >> 8));
+  SPI.transfer((char)address);
+  for (int i = 0; i < 32; i++)
+  {
+    SPI.transfer(buffer[i]);
+  }
+  disable();
+}
+
+void SpiRAM::read_stream(int address, char *buffer, int length)
+{
+  _set_mode(STREAM_MODE);
+  enable();
+  SPI.transfer(READ);
+  SPI.transfer((char)(address >> 8));
+  SPI.transfer((char)address);
+  for (int i = 0; i < length; i++)
+  {
+    buffer[i] = SPI.transfer(0xFF);
+  }
+  disable();
+}
+
+void SpiRAM::write_stream(int address, char *buffer, int length)
+{
+  _set_mode(STREAM_MODE);
+  enable();
+  SPI.transfer(WRITE);
+  SPI.transfer((char)(address >> 8));
+  SPI.transfer((char)address);
+  for (int i = 0; i < length; i++)
+  {
+    SPI.transfer(buffer[i]);
+  }
+  disable();
+}
+
+/*---------------------------------------------------------------------------
+ * The LED wire.
+ */
+static const int MAX_LANES = 8;
+static std::vector<byte> sFrame[MAX_LANES];
+static std::vector<byte> sLastFrame;
+static byte sByte[MAX_LANES];
+static byte sBits = 0;   //All lanes move in step, so one count does them all.
+static byte sLanes = 1;  //Most lanes seen since the last latch.
+static bool sInFrame = false;      //A bit has gone out since the last latch.
+static unsigned long sBitSpi = 0;  //stats.spiBytes at the last bit.
+static unsigned long sLatchUntil = 0;  //micros() when the last latch is done.
+
+void Sim::wireLanes(byte bits, byte lanes)
+{
+  ++stats.wireSlots;
+  stats.wireBits += lanes;
+  sWireNs += WIRE_NS_PER_SLOT;
+  sSlept += sWireNs / 1000;
+  sWireNs %= 1000;
+  //SPI traffic between bits is what stretches the gaps the strip can see.
+  if (sInFrame && stats.spiBytes - sBitSpi > stats.maxGapSpiBytes)
+  {
+    stats.maxGapSpiBytes = stats.spiBytes - sBitSpi;
+  }
+  if (!sInFrame && (long)(micros() - sLatchUntil) < 0)
+  {
+    ++stats.earlyFrames;  //First bit of a frame while the strip is still latching.
+  }
+  sInFrame = true;
+  sBitSpi = stats.spiBytes;
+  if (lanes > sLanes)
+  {
+    sLanes = lanes;
+  }
+  for (int k = 0; k < lanes; ++k)
+  {
+    sByte[k] = (sByte[k] << 1) | ((bits >> k) & 1);
+  }
+  if (++sBits == 8)
+  {
+    for (int k = 0; k < lanes; ++k)
+    {
+      sFrame[k].push_back(sByte[k]);
+      sByte[k] = 0;
+    }
+    sBits = 0;
+  }
+}
+
+void Sim::wireBit(bool val)
+{
+  wireLanes(val ? 1 : 0, 1);
+}
+
+void Sim::wireLatch(unsigned int holdUs)
+{
+  sLatchUntil = micros() + holdUs;
+  ++stats.frames;
+  sLastFrame.clear();
+  for (int k = 0; k < sLanes; ++k)
+  {
+    sLastFrame.insert(sLastFrame.end(), sFrame[k].begin(), sFrame[k].end());
+    sFrame[k].clear();
+    sByte[k] = 0;
+  }
+  sBits = 0;
+  sLanes = 1;
+  sInFrame = false;
+}
+
+const std::vector<byte>& Sim::lastFrame()
+{
+  return sLastFrame;
+}
+
+byte* Sim::spiRamImage(uint8_t pin)
+{
+  SpiRamChip* c = chipOn(pin);
+  if (!c)
+  {
+    return NULL;
+  }
+  if (c->mem.empty())
+  {
+    c->mem.assign(c->size, 0);
+  }
+  return &c->mem[0];
+}
+
+const std::vector<byte>& Sim::serialOutput()
+{
+  return sSerialOut;
+}
+
+unsigned long Sim::spiRamSize(uint8_t pin)
+{
+  SpiRamChip* c = chipOn(pin);
+  return c ? c->size : 0;
+}
+
+void Sim::reset()
+{
+  std::vector<SpiRamChip>& all = chips();
+  for (size_t i = 0; i < all.size(); ++i)
+  {
+    all[i].mem.assign(all[i].size, 0);
+    all[i].selected = false;
+  }
+  memset(&stats, 0, sizeof(stats));
+  sMasked = false;
+  for (int k = 0; k < MAX_LANES; ++k)
+  {
+    sFrame[k].clear();
+    sByte[k] = 0;
+  }
+  sLastFrame.clear();
+  sSerialOut.clear();
+  sBaud = 0;
+  sTxQueued = 0;
+  sBits = 0;
+  sLanes = 1;
+  sInFrame = false;
+  sNext = 1;
+}
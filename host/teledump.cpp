@@ -0,0 +1,108 @@
+/*teledump.cpp
+ * Decodes the telemetry records a USE_TELEMETRY build sends over Serial (see
+ * telemetry.h for the layout) and prints one block per record.  Feed it a
+ * capture of the serial port, or what bench saved:
+ *
+ *   teledump serial.bin
+ *   teledump < /dev/ttyACM0
+ *
+ * Anything between records (a boot message, a garbled record) is skipped over
+ * until the next magic with a good sum.
+ */
+#include <Arduino.h>
+#include <stdio.h>
+#include <vector>
+
+#define USE_TELEMETRY
+#include "../telemetry.h"
+
+static const char* STAGE_NAMES[Telemetry::STAGES] = { "walk", "getSpan", "setSpan", "sendWire", "display" };
+static const char* COUNTER_NAMES[Telemetry::COUNTERS] = { "spi B", "changed" };
+
+static unsigned int get16(const byte*& at)
+{
+  unsigned int v = at[0] | (at[1] << 8);
+  at += 2;
+  return v;
+}
+
+static bool goodRecord(const byte* rec)
+{
+  if (rec[0] != 'T' || rec[1] != 'L' || rec[2] != Telemetry::VERSION)
+  {
+    return false;
+  }
+  byte sum = 0;
+  for (int i = 2; i < Telemetry::RECORD_BYTES - 1; ++i)
+  {
+    sum += rec[i];
+  }
+  return sum == rec[Telemetry::RECORD_BYTES - 1];
+}
+
+static void printRecord(const byte* rec)
+{
+  const byte* at = rec + 3;
+  unsigned int seq = get16(at);
+  int frames = *at++;
+  unsigned int missed = get16(at);
+  printf("record %u, %d frames, %u missed\n", seq, frames, missed);
+  printf("  %-8s %6s %7s %7s %7s\n", "stage", "calls", "min us", "max us", "mean us");
+  for (int s = 0; s < Telemetry::STAGES; ++s)
+  {
+    unsigned int calls = get16(at);
+    unsigned int lo = get16(at);
+    unsigned int hi = get16(at);
+    unsigned int mean = get16(at);
+    printf("  %-8s %6u %7u %7u %7u\n", STAGE_NAMES[s], calls, lo, hi, mean);
+  }
+  for (int c = 0; c < Telemetry::COUNTERS; ++c)
+  {
+    unsigned int lo = get16(at);
+    unsigned int hi = get16(at);
+    unsigned int mean = get16(at);
+    printf("  %-8s %6s %7u %7u %7u\n", COUNTER_NAMES[c], "", lo, hi, mean);
+  }
+}
+
+int main(int argc, char** argv)
+{
+  FILE* f = argc > 1 ? fopen(argv[1], "rb") : stdin;
+  if (!f)
+  {
+    fprintf(stderr, "teledump: can't open %s\n", argv[1]);
+    return 1;
+  }
+  std::vector<byte> in;
+  int ch;
+  while ((ch = fgetc(f)) != EOF)
+  {
+    in.push_back((byte)ch);
+  }
+
+  long records = 0;
+  long skipped = 0;
+  long expect = -1;  //Next seq we should see.
+  long dropped = 0;
+  size_t i = 0;
+  while (i + Telemetry::RECORD_BYTES <= in.size())
+  {
+    if (!goodRecord(&in[i]))
+    {
+      ++i;
+      ++skipped;
+      continue;
+    }
+    unsigned int seq = in[i + 3] | (in[i + 4] << 8);
+    if (expect >= 0 && seq != expect)
+    {
+      dropped += (seq - expect) & 0xFFFF;
+    }
+    expect = (seq + 1) & 0xFFFF;
+    printRecord(&in[i]);
+    ++records;
+    i += Telemetry::RECORD_BYTES;
+  }
+  printf("%ld records, %ld dropped, %ld bytes skipped\n", records, dropped, skipped + (long)(in.size() - i));
+  return 0;
+}
@@ -0,0 +1,175 @@
+/*unit.cpp
+ * Checks of the pieces the bench and replays only ever drive one way: the
+ * SPI RAM allocator's free and reuse paths, and DirtyMap's runs at the edges
+ * of its bytes.  Prints each check that fails and exits 1 if any did.
+ *
+ *   unit
+ *
+ * CONFIG.h's pix array has its block before main() runs, so the allocator
+ * checks work around it rather than from an empty chip.
+ */
+#include <Arduino.h>
+#include <Sim.h>
+#include <stdio.h>
+#include <type_traits>
+
+#include "../CONFIG.h"
+#include "../dirtymap.h"
+
+static int failures = 0;
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+static void check(bool ok, const char* what, int line)
+{
+  if (!ok)
+  {
+    printf("unit.cpp:%d: failed: %s\n", line, what);
+    ++failures;
+  }
+}
+
+//Copying any of these would free their memory twice.
+static_assert(!std::is_copy_constructible<DirtyMap>::value, "DirtyMap can be copied");
+static_assert(!std::is_copy_assignable<DirtyMap>::value, "DirtyMap can be assigned");
+static_assert(!std::is_copy_constructible<SramStore<ColorLayout> >::value, "SramStore can be copied");
+static_assert(!std::is_copy_assignable<SramStore<ColorLayout> >::value, "SramStore can be assigned");
+static_assert(!std::is_copy_constructible<SpiStore<ColorLayout> >::value, "SpiStore can be copied");
+static_assert(!std::is_copy_assignable<SpiStore<ColorLayout> >::value, "SpiStore can be assigned");
+
+//First fit: freed blocks leave gaps, and the first gap big enough gets used.
+static void spiAlloc()
+{
+  using namespace spiMem;
+  SpiAddr base = spi_in_use();
+  byte blocks = num_blocks;
+
+  CHECK(spi_alloc(0) == SPI_NULL);
+  CHECK(spi_alloc(MEMSIZE) == SPI_NULL);  //Page 0 is never handed out.
+
+  SpiAddr a = spi_alloc(100);
+  SpiAddr b = spi_alloc(PAGE_BYTES);
+  SpiAddr c = spi_alloc(64);
+  CHECK(a != SPI_NULL && b != SPI_NULL && c != SPI_NULL);
+  CHECK(a % PAGE_BYTES == 0 && b % PAGE_BYTES == 0 && c % PAGE_BYTES == 0);
+  CHECK(spi_in_use() == base + 128 + PAGE_BYTES + 64);  //100 rounds up to whole pages.
+  CHECK(b == a + 128 && c == b + PAGE_BYTES);
+  SpiAddr high = spi_high_water();
+
+  spi_free(b);
+  CHECK(spi_in_use() == base + 128 + 64);
+  CHECK(spi_alloc(20) == b);  //Back in b's gap.
+
+  spi_free(a);
+  SpiAddr d = spi_alloc(200);  //Too big for a's gap: goes after c.
+  CHECK(d == c + 64);
+  CHECK(spi_alloc(128) == a);  //Just fits a's gap.
+  CHECK(spi_high_water() == d + 224 && spi_high_water() > high);
+
+  spi_free(SPI_NULL);  //Like free(NULL).
+  spi_free(a + 1);     //Not a block: nothing happens.
+  CHECK(spi_in_use() == base + 128 + PAGE_BYTES + 64 + 224);
+
+  //The table is full at MAX_BLOCKS, whatever room is left.
+  SpiAddr more[MAX_BLOCKS];
+  byte got = 0;
+  while (num_blocks < MAX_BLOCKS)
+  {
+    more[got] = spi_alloc(PAGE_BYTES);
+    CHECK(more[got] != SPI_NULL);
+    ++got;
+  }
+  CHECK(spi_alloc(PAGE_BYTES) == SPI_NULL);
+  for (byte i=0; i<got; ++i)
+  {
+    spi_free(more[i]);
+  }
+
+  spi_free(a);
+  spi_free(b);
+  spi_free(c);
+  spi_free(d);
+  CHECK(spi_in_use() == base && num_blocks == blocks);
+  CHECK(spi_high_water() >= d + 224);  //Only ever goes up.
+}
+
+//The runs nextRun finds from 0 on, as first,count pairs, and how many.
+static int runs(DirtyMap& map, int mergeGap, int* out)
+{
+  int n;
+  int found = 0;
+  for (int id=map.nextRun(0, n, mergeGap); id>=0; id=map.nextRun(id+n, n, mergeGap))
+  {
+    out[2 * found] = id;
+    out[2 * found + 1] = n;
+    ++found;
+  }
+  return found;
+}
+
+static void dirtyMap()
+{
+  DirtyMap map;
+  CHECK(map.alloc(21));  //Two whole bytes and 5 bits of a third.
+  CHECK(!map.any() && map.count() == 0);
+  int n = 99;
+  CHECK(map.nextRun(0, n) == -1 && n == 0);
+
+  //Either side of each byte boundary, and the very last pixel.
+  map.mark(7);
+  map.mark(8);
+  map.mark(15);
+  map.mark(20);
+  map.mark(21);   //Past the end: ignored.
+  map.mark(-1);
+  CHECK(map.count() == 4 && map.any());
+  CHECK(map.test(7) && map.test(8) && map.test(20) && !map.test(9) && !map.test(21) && !map.test(-1));
+  CHECK(map.get(7) == 0x80 && map.get(8) == 0x81 && map.get(20) == 0x10 && map.get(21) == 0);
+
+  int r[16];
+  CHECK(runs(map, 0, r) == 3);
+  CHECK(r[0] == 7 && r[1] == 2);    //Across the first boundary.
+  CHECK(r[2] == 15 && r[3] == 1);
+  CHECK(r[4] == 20 && r[5] == 1);   //Ends the map.
+
+  //Gaps of up to mergeGap clean pixels are bridged, longer ones aren't.
+  CHECK(runs(map, 3, r) == 3);  //4 clean between 15 and 20, 6 between 8 and 15.
+  CHECK(runs(map, 4, r) == 2 && r[0] == 7 && r[1] == 2 && r[2] == 15 && r[3] == 6);
+  CHECK(runs(map, 6, r) == 1 && r[0] == 7 && r[1] == 14);
+  CHECK(runs(map, 100, r) == 1 && r[0] == 7 && r[1] == 14);  //Never past the last changed pixel.
+  CHECK(map.nextRun(9, n) == 15 && n == 1);  //From inside a byte.
+  CHECK(map.nextRun(16, n, 5) == 20 && n == 1);
+  CHECK(map.nextRun(-3, n) == 7 && n == 2);
+
+  map.clear();
+  CHECK(!map.any() && map.count() == 0 && map.nextRun(0, n, 5) == -1);
+
+  //A whole run, and one clean pixel in it.
+  map.markRange(3, 16);
+  CHECK(map.count() == 16 && runs(map, 0, r) == 1 && r[0] == 3 && r[1] == 16);
+  map.clear();
+  map.markRange(0, 8);
+  map.markRange(9, 12);  //Runs off the end: stops at 20.
+  CHECK(map.count() == 20);
+  CHECK(runs(map, 0, r) == 2 && r[0] == 0 && r[1] == 8 && r[2] == 9 && r[3] == 12);
+  CHECK(runs(map, 1, r) == 1 && r[0] == 0 && r[1] == 21);
+
+  //alloc() again starts clean at the new size.
+  CHECK(map.alloc(8) && !map.any());
+  map.mark(7);
+  map.mark(8);
+  CHECK(map.count() == 1 && map.nextRun(0, n) == 7 && n == 1);
+}
+
+int main()
+{
+  spiAlloc();
+  dirtyMap();
+  if (failures)
+  {
+    printf("%d failed\n", failures);
+    return 1;
+  }
+  printf("unit: all pass\n");
+  return 0;
+}
@@ -5,6 +5,13 @@
 #ifndef LITE_PIXEL_H  
 #define LITE_PIXEL_H
 
+#ifdef HOST_SIM
+#include <Sim.h>  //Host build: bits land in a frame buffer instead of on a pin.
+#endif
+#if BRITE_TABLE && BRITE_GAMMA
+#include "gamma.h"
+#endif
+
  // These values depend on which pin your string is connected to and what board you are using 
 // More info on how to find these at http://www.arduino.cc/en/Reference/PortManipulation
 #define PIXEL_PORT  PORTD  // Port of the pin the pixels are connected to
@@ -19,9 +26,9 @@
 #define T0H  400    // Width of a 0 bit in ns
 #define T0L  900    // Width of a 0 bit in ns
 
-// The reset gap can be 6000 ns, but depending on the LED strip it may have to be increased
-// to values like 600000 ns. If it is too small, the pixels will show nothing most of the time.
-#define RES 6000    // Width of the low gap between bits to cause a frame to latch
+// How long show() holds the line low before the next frame may start.
+#define LATCH_HOLD_US 120
+static_assert(LATCH_HOLD_US > LATCH_US, "show() has to hold the line low longer than it takes the strip to latch");
 
 // Here are some convience defines for using nanoseconds specs to generate actual CPU delays
 
@@ -33,21 +40,71 @@
 
 #define NS_TO_CYCLES(n) ( (n) / NS_PER_CYCLE )
 
+/*Every gap on the wire is held to the one threshold, LATCH_US (see CONFIG.h):
+ * between two bits, two bytes, and two pixels, with whatever interrupts were
+ * let in there.
+ * EMIT_GAP_US is the most display_pix does between two pixels, worked out
+ * from what it reads there with the costs CONFIG.h counts (the host bench
+ * measures it as 'max gap spi B').  One strip streams: at the start of a
+ * segment, a reversed pixel or a chip, a new burst and a pixel's bytes.  Lanes
+ * go out a byte at a time, and the gap before a byte holds that byte's fetch
+ * from every lane (see sendLaneBytes) as well as one lane's span read; they
+ * let interrupts in at the end of the span, in a gap with neither.
+ * LANE_BIT_GAP_NS is the low between two bits of a byte on lanes.
+ */
+#define LANE_GATHER_CYCLES 9
+#define LANE_FETCH_CYCLES  8
+#define LANE_BIT_GAP_NS  ( T1L + NS_PER_CYCLE * ( LED_LANES * LANE_GATHER_CYCLES + 4 ) )
+#define LANE_BYTE_GAP_NS ( T1L + NS_PER_CYCLE * ( LED_LANES * ( LANE_GATHER_CYCLES + LANE_FETCH_CYCLES ) + 8 ) )
+#if LED_LANES > 1
+#define EMIT_GAP_US     (CONFIG::SPAN_READ_US + (LANE_BYTE_GAP_NS + 999) / 1000)
+#define EMIT_ISR_GAP_US (ISR_BUDGET_US + (LANE_BYTE_GAP_NS + 999) / 1000)
+static_assert(LANE_BIT_GAP_NS < 1000L * LATCH_US, "Gathering a bit from every lane holds the wire low past the latch");
+#else
+#define EMIT_GAP_US     (CONFIG::BURST_US + CONFIG::PIX_US)
+#define EMIT_ISR_GAP_US (ISR_BUDGET_US + EMIT_GAP_US)
+#endif
+static_assert(EMIT_GAP_US < LATCH_US, "display_pix reads long enough between two pixels to latch the strip");
+static_assert(EMIT_GROUP_PIX == 0 || EMIT_ISR_GAP_US < LATCH_US, "Interrupts between pixels could latch the strip early");
+static_assert(EMIT_GROUP_PIX * 24L * (T1H + T1L) / 1000 < 1024, "EMIT_GROUP_PIX keeps interrupts off longer than a millis() tick");
+
 class LitePixel
 {
   public:
+    LitePixel() : mLatchAt(0) {}
     inline void sendBit( bool vitVal );
+    inline void sendLanes( unsigned char bits );
     inline void sendByte( unsigned char byte );
     inline void sendPixel( unsigned char r, unsigned char g , unsigned char b );
+    inline void sendBytes( const unsigned char* bytes, int count );
+    inline void sendLaneBytes( const unsigned char* bytes, int stride, int count );
+    inline void letInterruptsIn();
     void showColor( unsigned char r , unsigned char g , unsigned char b );
     void setup();
+#if BRITE_TABLE
+    void setBrightness( unsigned char brite );  //0 is dark, 255 as bright as the pixels say.
+#endif
     void show();
+    inline bool latched();   //Has the last show() finished latching?
+    void waitLatch();        //Wait until it has.
+    template <class Idle> void waitLatch( Idle& idle );  //Call idle.idle() until it has.
+  private:
+    inline unsigned char adjust( unsigned char byte );  //A byte as it goes out.
+    unsigned long mLatchAt;  //micros() when the last show() is done.
+#if BRITE_TABLE
+    unsigned char mBrite[256];  //What each byte value goes out as.
+#endif
 };
 // Actually send a bit to the string. We must to drop to asm to enusre that the complier does
 // not reorder things and make it so the delay happens in the wrong place.
 
 inline void LitePixel::sendBit( bool bitVal ) 
 {  
+#if LED_LANES > 1
+  sendLanes( bitVal ? 0xFF : 0 );  //Same bit on every lane.
+#elif defined(HOST_SIM)
+  Sim::wireBit( bitVal );
+#else
   if (  bitVal )
   {        // 0 bit
     asm volatile (
@@ -91,15 +148,73 @@ inline void LitePixel::sendBit( bool bitVal )
         
       );    
   }
+#endif //LED_LANES
     
-  // Note that the inter-bit gap can be as long as you want as long as it doesn't exceed the 5us reset timeout (which is A long time) 
+  // Note that the inter-bit gap can be as long as you want as long as it doesn't exceed LATCH_US (see CONFIG.h) 
   // Here I have been generous and not tried to squeeze the gap tight but instead erred on the side of lots of extra time.
   // This has thenice side effect of avoid glitches on very long strings becuase   
 }  
 
+
+/*Send one bit on every lane at once.  Bit k of bits goes out on lane k.
+ * Every lane goes high together, the lanes sending a 0 drop at T0H, the ones
+ * sending a 1 drop at T1H, and the rest of the port is left as it was.  It's
+ * the same waveform sendBit makes, written with 'out' to the whole port
+ * instead of 'sbi'/'cbi' to one pin, so it costs the same whether we drive 1
+ * lane or 8.
+ */
+inline void LitePixel::sendLanes( unsigned char bits )
+{
+#ifdef HOST_SIM
+  Sim::wireLanes( bits, LED_LANES );
+#else
+  unsigned char lo = PIXEL_PORT & ~CONFIG::LANE_MASK;  //Port as it is, every lane low.
+  unsigned char hi = lo | CONFIG::LANE_MASK;
+  unsigned char data = lo | ( (bits << CONFIG::PIN_LED) & CONFIG::LANE_MASK );
+  asm volatile (
+    "out %[port], %[hi] \n\t"       // Every lane high
+    ".rept %[zeroCycles] \n\t"      // Long enough for a 0
+    "nop \n\t"
+    ".endr \n\t"
+    "out %[port], %[data] \n\t"     // Lanes sending a 0 go low, lanes sending a 1 stay high
+    ".rept %[oneCycles] \n\t"       // The rest of the way to a 1
+    "nop \n\t"
+    ".endr \n\t"
+    "out %[port], %[lo] \n\t"       // Every lane low
+    ".rept %[offCycles] \n\t"
+    "nop \n\t"
+    ".endr \n\t"
+    ::
+    [port]    "I" (_SFR_IO_ADDR(PIXEL_PORT)),
+    [hi]      "r" (hi),
+    [data]    "r" (data),
+    [lo]      "r" (lo),
+    [zeroCycles]  "I" (NS_TO_CYCLES(T0H) - 1),        // 1 cycle for each out
+    [oneCycles]   "I" (NS_TO_CYCLES(T1H - T0H) - 1),
+    [offCycles]   "I" (NS_TO_CYCLES(T1L) - 1)
+  );
+#endif //HOST_SIM
+}
   
+/*Brightness and gamma happen here, on the way out, with a table lookup.
+ * Counted by hand on the AVR (the host sim counts bytes on the wire, not
+ * cycles): the byte added to the table's address, add and adc, then a load,
+ * about 5 cycles or 0.3us at 16MHz.  It comes before the first bit, while the
+ * wire sits low after the last bit of the byte before, so it makes that low
+ * 0.9us rather than 0.6, far inside LATCH_US.  With BRITE_TABLE 0 it's nothing.
+ */
+inline unsigned char LitePixel::adjust( unsigned char byte )
+{
+#if BRITE_TABLE
+  return mBrite[byte];
+#else
+  return byte;
+#endif
+}
+
 inline void LitePixel::sendByte( unsigned char byte )
 {    
+  byte = adjust( byte );
   for( unsigned char bit = 0 ; bit < 8 ; bit++ ) {
     
     sendBit( bitRead( byte , 7 ) );                // Neopixel wants bit in highest-to-lowest order
@@ -124,10 +239,31 @@ inline void LitePixel::sendByte( unsigned char byte )
 
 void LitePixel::setup()
 {
-  bitSet( PIXEL_DDR , CONFIG::PIN_LED ); 
+  PIXEL_DDR |= CONFIG::LANE_MASK;  //Every lane pin is an output.
+#if BRITE_TABLE
+  setBrightness( CONFIG::MAX_BRITE );
+#endif
   showColor(0,0,0); //Black the output.
 }
 
+#if BRITE_TABLE
+/*Work the table out again for a new brightness: gamma first, then scaled.
+ * That's 256 multiplies, a fraction of a millisecond, once, instead of one
+ * for every byte of every frame.  Between frames is the time to call it.
+ */
+void LitePixel::setBrightness( unsigned char brite )
+{
+  for( int v=0; v<256; v++ ) {
+#if BRITE_GAMMA
+    unsigned int level = pgm_read_byte( &GAMMA[v] );
+#else
+    unsigned int level = v;
+#endif
+    mBrite[v] = ( level * brite + 127 ) / 255;  //Rounded, so 255 leaves it as it was.
+  }
+}
+#endif
+
 inline void LitePixel::sendPixel( unsigned char r, unsigned char g , unsigned char b )
 {  
   sendByte(g);          // Neopixel wants colors in green then red then blue order
@@ -136,20 +272,141 @@ inline void LitePixel::sendPixel( unsigned char r, unsigned char g , unsigned ch
 }
 
 
-// Just wait long enough without sending any bits to cause the pixels to latch and display the last sent frame
+// Send bytes that are already in wire order (green, red, blue for each pixel).
 
+inline void LitePixel::sendBytes( const unsigned char* bytes, int count )
+{
+  for( int i=0; i<count; i++ ) {
+    sendByte( bytes[i] );
+  }
+}
+
+/*Send count bytes down each lane.  Lane k's bytes start at bytes + k*stride.
+ * The strip wants each byte one bit at a time, so for every bit we gather that
+ * bit from all the lanes into one byte (bit k from lane k) and sendLanes() it:
+ * the bytes are transposed as they go out.  The gathering happens in the low
+ * part of the bit before, so it stretches every low; the first bit's gather
+ * also fetches the lanes' bytes (and looks them up in the brightness table).
+ * Counted by hand on the AVR, a lane costs about LANE_GATHER_CYCLES a bit
+ * (load, shift, rotate, store, loop) and LANE_FETCH_CYCLES more for the fetch.
+ * At 8 lanes that's 76 cycles, 4.75us, on top of T1L between two bits, and
+ * about 9us between two bytes, before anything the caller does there.  Both
+ * are held to LATCH_US with the rest of the gaps, above.
+ */
+inline void LitePixel::sendLaneBytes( const unsigned char* bytes, int stride, int count )
+{
+  unsigned char lane[LED_LANES];
+  for( int i=0; i<count; i++ ) {
+    unsigned char bits = 0;
+    for( int k=LED_LANES-1; k>=0; k-- ) {  //Highest lane first so lane 0 ends up in bit 0.
+      unsigned char b = adjust( bytes[k * stride + i] );
+      bits = (bits << 1) | (b >> 7);  //Highest bit first, as in sendByte.
+      lane[k] = b << 1;
+    }
+    sendLanes( bits );
+    for( unsigned char bit = 1 ; bit < 8 ; bit++ ) {
+      bits = 0;
+      for( int k=LED_LANES-1; k>=0; k-- ) {
+        bits = (bits << 1) | (lane[k] >> 7);
+        lane[k] <<= 1;
+      }
+      sendLanes( bits );
+    }
+  }
+}
+
+/*Briefly turn interrupts back on, between two pixels, so anything that came
+ * in while we were sending gets handled.  The AVR always runs the instruction
+ * after sei before it takes an interrupt, hence the nop.  Each pending
+ * interrupt then runs, and we're back to sending.
+ */
+inline void LitePixel::letInterruptsIn()
+{
+  sei();
+#ifndef HOST_SIM
+  asm volatile ( "nop \n\t" );
+#endif
+  cli();
+}
+
+/*EmitGroups passes bytes on to a LitePixel and lets interrupts in after
+ * every EMIT_GROUP_PIX pixels' worth.  Hand it to PixelArray::sendWire in
+ * place of the LitePixel itself.
+ */
+class EmitGroups
+{
+  public:
+    EmitGroups( LitePixel& lite ) : mLite(lite), mLeft(GROUP_BYTES) {}
+    inline void sendByte( unsigned char byte );
+  private:
+    static const int GROUP_BYTES = EMIT_GROUP_PIX * 3;
+    LitePixel& mLite;
+    int mLeft;  //Bytes to go before the next window.
+};
+
+inline void EmitGroups::sendByte( unsigned char byte )
+{
+  mLite.sendByte( byte );
+  if( --mLeft == 0 ) {
+    mLeft = GROUP_BYTES;
+    mLite.letInterruptsIn();
+  }
+}
+
+/*Latch the frame: the strip shows what we sent once the line has been low
+ * long enough.  We used to wait that out right here.  Now show() just notes
+ * when it will be done and goes back to work; every routine that sends
+ * starts with waitLatch(), so no frame can start on top of the last one.
+ */
 void LitePixel::show()
 {
-  delayMicroseconds(120);
+#ifdef HOST_SIM
+  Sim::wireLatch( LATCH_HOLD_US );
+#endif
+  mLatchAt = micros() + LATCH_HOLD_US;
+}
+
+inline bool LitePixel::latched()
+{
+  return (long)(micros() - mLatchAt) >= 0;  //Still right when micros() wraps.
+}
+
+//A delay rather than a spin on micros(), so the host build skips the wait.
+void LitePixel::waitLatch()
+{
+  if( !latched() ) {
+    delayMicroseconds( mLatchAt - micros() );
+  }
+}
+
+/*The same wait, spent on idle.idle() for as long as it has work to do.  Each
+ * idle() should be a small piece of work, a few microseconds, and return
+ * false once there's nothing left.
+ */
+template <class Idle>
+void LitePixel::waitLatch( Idle& idle )
+{
+  while( !latched() ) {
+    if( !idle.idle() ) {
+      waitLatch();
+      return;
+    }
+  }
 }
 
 // Display a single color on the whole string
 
 void LitePixel::showColor( unsigned char r , unsigned char g , unsigned char b )
 {
+  waitLatch();
   cli();  
-  for( int p=0; p<CONFIG::NUM_LEDS; p++ ) {
+  for( int p=0; p<CONFIG::LANE_PIX; p++ ) {  //sendBit drives every lane, so one lane's worth does the lot.
     sendPixel( r , g , b );
+#if EMIT_GROUP_PIX > 0
+    if( (p + 1) % EMIT_GROUP_PIX == 0 ) {
+      letInterruptsIn();
+    }
+#endif
   }
   sei();
   show();
@@ -1,200 +1,135 @@
 /* pixelarray.h
- *  Manages an array of pixel values for our RGB array. 
- *  If #define USE_SPI_PIX is set, will store the array in
- *  SPI RAM.  Otherwise it will use arduino memory.  
- *  See CONFIG.h
+ *  Manages an array of pixel values for our RGB array.
+ *  Where the pixels live (arduino memory or SPI RAM) and how they are laid
+ *  out (4 byte COLOR or packed wire bytes) is the Store template parameter,
+ *  see pixstore.h.  CONFIG.h picks the store from USE_SPI_MEM and
+ *  USE_PACKED_PIX.
  */
-#ifndef PIXELARRAY_H  
+#ifndef PIXELARRAY_H
 #define PIXELARRAY_H
 
 #include "CONFIG.h"
-#include "spi_mem.h"
+#include "pixstore.h"
+#include "dirtymap.h"
+#include "telemetry.h"
 
  /*pix is 4 bytes per LED. Remember our 328 CPU only has 2K of active memory.
    * if you have 512 pix, that's all of the memory including the memory for calling functions
-   * making computations, talking to our libraries, etc. 
+   * making computations, talking to our libraries, etc.
    * We will address this in a later version by using a 32K expansion chip on the IC2 bus.
    */
+
+/*Update flags are a template parameter too.  NoFlags is the default and all
+ * of its calls are empty, so they vanish from the build entirely.  For flags
+ * that work, use a DirtyMap (dirtymap.h): PixelArray<PixStore, DirtyMap>.
+ * It keeps one bit per pixel in arduino memory, 49 bytes for 388 pixels.
+ */
+class NoFlags
+{
+public:
+  bool alloc(int /*num_pix*/) { return true; }
+  inline void mark(int /*id*/) {}
+  inline void clear(int /*num_pix*/) {}
+  inline bool test(int /*id*/) { return true; }  //Without flags, anything might have changed.
+  inline byte get(int /*id*/) { return 0xFF; }  //Return true if not using updateflags.
+};
+
+
+/*FRAMES is how many copies of the pixels we keep.  With 2 we have a front
+ * frame, the one on show, and a back frame, the one being worked out.  Reads
+ * (get, getSpan, getWire, sendWire) come from the front and writes (set,
+ * setSpan) go to the back, and swap() trades them over without moving a
+ * pixel.  So an effect reads last frame as it stands while it writes the next
+ * one, and nothing it writes reaches the strip until the swap.  The back frame
+ * is two frames old when the effect starts on it, so the effect has to write
+ * every pixel, changed or not.
+ * With 1 (the default) front and back are the same pixels and swap() only
+ * flushes.
+ */
+template <class Store, class Flags = NoFlags, byte FRAMES = 1>
 class PixelArray
 {
 private:
   int mNumPix;  //Number of pixels in array
-  bool mUseSPI; //Set true if using SPI memory to hold our array.
-  bool mUseUpdateFlags; //If true, store changes to limit writing to pix array.
-  bool mUseSPIFlags; //True to use SPI mem for flags.
-  COLOR* mMemAddr; //Base address in memory where our array is held.
-  int*  mUFAddr;  //Base address for update flags array.
+  bool mHaveMem;  //False if we couldn't get memory for the pixels.
+  Store mStore[FRAMES];  //The pixels themselves, a Store per frame.
+  byte mFront;  //Which of mStore is the front frame.
+  Flags mFlags;  //Which pixels changed.
+  inline Store& front() { return mStore[mFront]; }
+  inline Store& back() { return mStore[(mFront + 1) % FRAMES]; }  //mStore[0] when FRAMES is 1.
 public:
-  PixelArray(int num_pix, bool use_spi_mem, bool use_update_flags, bool use_spi_flags );
-  void set(int id, COLOR color);
+  PixelArray(int num_pix);
+  inline void swap();    //The back frame is now on show.
+  inline bool doubleBuffered() { return FRAMES > 1; }
+  inline void set(int id, COLOR color);
   void set(int id, int col, byte val);
   void set(int id, byte r, byte g, byte b);
-  COLOR get(int id);
+  inline COLOR get(int id);
+  inline void getSpan(int first, int count, COLOR* out);   //Burst read count pixels.
+  inline void setSpan(int first, int count, const COLOR* in); //Burst write count pixels.
+  inline void getWire(int first, int count, byte* out);   //Burst read as GRB bytes for the strip.
+  template <class Sink> inline void sendWire(int first, int count, Sink& out);  //GRB bytes to out.sendByte().
+  inline void flush();   //Write any cached changes out to SPI RAM.
+  unsigned long cacheHits();
+  unsigned long cacheMisses();
   void flushFlags();
-  void flag(int id);
+  inline void flag(int id);
   byte getFlags(int id);
-private:
-  COLOR* memAlloc( int num_pix );
-  COLOR* spiAlloc( int num_pix );
+  //Only with Flags = DirtyMap.  See DirtyMap::count and nextRun.
+  int dirtyCount();
+  int nextDirty(int from, int& count, int mergeGap = 0);
 };
 
-
-COLOR* PixelArray::memAlloc( int num_pix )
+template <class Store, class Flags, byte FRAMES>
+PixelArray<Store, Flags, FRAMES>::PixelArray(int num_pix)
 {
-  COLOR* ret = NULL;
-  /*TODO 256 is terrible constant and this is a bad place for it.
-   * None the less, I want to do a bare first pass and not overflowing
-   * memory here.  I know COLOR is4 bytes and 256x4=1024 or half the 
-   * available memory so let's limit to that for now.  We can tune this
-   * later if it ever comes up.
-   */
-  if (num_pix > 256)  
+  mNumPix = num_pix;
+  mFront = 0;
+  mHaveMem = true;
+  for (byte f=0; f<FRAMES; ++f)
   {
-    return ret;  //Too big, return NULL ptr;
+    mHaveMem = mStore[f].alloc( mNumPix ) && mHaveMem;
   }
-  return (COLOR*)malloc(sizeof(COLOR) * num_pix);
-}
-
-COLOR* PixelArray::spiAlloc( int num_pix )
-{
-  COLOR* ret = NULL;
-  return (COLOR*)spiMem::spi_alloc( sizeof(COLOR) * num_pix );
-}
-
-PixelArray::PixelArray(int num_pix, bool use_spi_mem, bool use_update_flags, bool use_spi_flags)
-{
-  mNumPix = num_pix;
-  mUseUpdateFlags = use_update_flags;
-  mUseSPIFlags = use_spi_flags;
-  mUseSPI = use_spi_mem;
-  /*TODO:  Right now we have nothing else in memory on our SPI RAM chip so 
-   * we're just going to set our base address to 0.   This means we're doing 
-   * some extra computation on derferencing pixels, but in the future we may 
-   * want to put more things in our auxiallary memory, but let's put off writing
-   * our own memory manager for a later version.  Right now we want light!
-   */
-   if (mUseSPI)
-   {
-      mMemAddr = spiAlloc( sizeof(COLOR) * mNumPix );
-   }
-   else
-   {
-      mMemAddr = memAlloc (sizeof(COLOR) * mNumPix);
-   }
-   if (!mMemAddr) //Allocation failed
-   {
-      //??? what are we going to do for error handling?
-      //TODO decide allocate fail behavior and fail behavior in general. 
-   }
-
-  if (mUseUpdateFlags)
+  if (!mHaveMem) //Allocation failed
   {
-    if (mUseSPIFlags)
-    {
-     /*The bool type 
-      * is actually stored as an int internally.  2 bytes for every bit.
-      * What we'll do instead is create a bit-to-bit mapping using divide
-      * and modulo to address our mask flags.
-      * We'll start that process here by allocating the memory.  Ceil is 
-      * divide and round up.  So 7/8=1, 8/8=1, 9/8=2 etc 
-      */
-      mUFAddr = spiMem::spi_alloc( ceil(mNumPix/8) );
-    }
-    else
-    {
-      mUFAddr = (int *)malloc( ceil(mNumPix/8) ); //See above comment.
-    }
-    if (!mUFAddr) //Allocation failed
-    {
-       //This isnt' fatal, it will just make our updates slow.
-       //TODO warn the developer the allocation failed.
-       mUseUpdateFlags = false;  //If no memory addr, don't use.
-    }
+    //??? what are we going to do for error handling?
+    //TODO decide allocate fail behavior and fail behavior in general.
+    //For now spans read as black and writes go nowhere.
   }
-}
-
-void PixelArray::flag(int id)
-{
-  static int oidx=0xFFFF;
-  static byte flags;
-  if (mUseUpdateFlags)
+  if (!mFlags.alloc( mNumPix ))
   {
-    int idx1, idx2;
-    idx1 = id/8;
-    idx2 = id%8;
-
-    if (idx1 != oidx)
-    {
-      if (mUseSPIFlags)
-      {
-        if (oidx!=0xFFFF)
-        {
-          SpiRam.write_stream(*mUFAddr + oidx, &flags, 1 );
-        }
-        //Read bitmask for 8 sequential pixels
-        SpiRam.read_stream(*mUFAddr + idx1, flags, 1);
-      }
-      else
-      {
-        if (oidx!=0xFFFF)
-        {
-           mUFAddr[oidx] = flags;
-        }
-        flags=mUFAddr[idx1];
-      }
-
-      oidx = idx1;
-
-      /*Take a 1, shift it over the modulo bits, logically OR it with 
-       * the bitmask, and write it back out.  
-       * Say we are changing pixel 3.  Because idx1 is an int, 
-       * 3/8=0 so we'll be getting the 0th block, pixels 0-7
-       * We'll then take 1 and shift it 3 places to binary 1000
-       * Logical OR (|) basically gives you all the 1s from 2 byte arrays.
-       * IE 10101010 | 01010101 = 11111111; 11101111 | 10101010 = 11101111
-       */
-      flags = flags | (1<<idx2);
-    }
+    //This isnt' fatal, it will just make our updates slow.
+    //TODO warn the developer the allocation failed.
   }
 }
 
-void PixelArray::set(int id, COLOR col)
+template <class Store, class Flags, byte FRAMES>
+inline void PixelArray<Store, Flags, FRAMES>::flag(int id)
 {
-  int csize = sizeof(COLOR);
+  mFlags.mark(id);
+}
 
-  if (mUseSPI)
-  {
-/*In C++ you can do ANYTHING you want.  With this great power should come
-* great responsibility, but sometimes you are going to see code that looks 
-* like this.  Power blatantly abused for reasons of dubious value.  
-*
-*Data is data.  We're casting our *COLOR memory address to an integer. 
-*NOTE: using int rather than short is least-fragile here.  If we went to a 
-*system where int is defined as long, this awful conversion still works. 
-*So, we're getting the number we stashed there as an index into spi mem
-*and adding to it the byte offset of the pixel ID times the sizeof our 
-*color data.
-*Next, we are doing some ugly type conversion, casting the address of 
-*our local variable to a byte array pointer. 
-*/
-      SpiRam.write_stream( (int*)mMemAddr + ( id * csize ),
-                          (byte*)(&col), csize);
-  }
-  else
-  {
-      *(mMemAddr + id) = col;
-  }
+/*get() and set() are the single pixel calls.  They trust that we got our
+ * memory; the span calls below check.
+ */
+template <class Store, class Flags, byte FRAMES>
+inline void PixelArray<Store, Flags, FRAMES>::set(int id, COLOR col)
+{
+  back().set(id, col);
   flag(id);
 }
 
-void PixelArray::set(int id, int col, byte val)
+//With two frames the other channels come from the front frame's pixel.
+template <class Store, class Flags, byte FRAMES>
+void PixelArray<Store, Flags, FRAMES>::set(int id, int col, byte val)
 {
   COLOR foo = get(id);
   foo.c[col] = val;
   set(id, foo);
 }
 
-void PixelArray::set(int id, byte r, byte g, byte b)
+template <class Store, class Flags, byte FRAMES>
+void PixelArray<Store, Flags, FRAMES>::set(int id, byte r, byte g, byte b)
 {
   COLOR foo;
   foo.c[0] = r;
@@ -203,57 +138,147 @@ void PixelArray::set(int id, byte r, byte g, byte b)
   set(id, foo);
 }
 
-COLOR PixelArray::get(int id)
+template <class Store, class Flags, byte FRAMES>
+inline COLOR PixelArray<Store, Flags, FRAMES>::get(int id)
+{
+  return front().get(id);
+}
+
+/*getSpan and setSpan move a run of sequential pixels in one go.  On SPI
+ * that's a single chip-select, command and address followed by every byte of
+ * the run, where get() and set() pay that overhead for every 4-byte pixel.
+ * The 23K256 stream mode just keeps counting up the addresses for us.
+ */
+template <class Store, class Flags, byte FRAMES>
+inline void PixelArray<Store, Flags, FRAMES>::getSpan(int first, int count, COLOR* out)
 {
-  COLOR col;
-  int csize = sizeof(long);
+  if (!mHaveMem)
+  {
+    memset(out, 0, sizeof(COLOR) * count);  //No storage reads as black.
+    return;
+  }
+  TELE_BEGIN(Telemetry::GET);
+  front().read(first, count, out);
+  TELE_END(Telemetry::GET);
+}
 
-  if (mMemAddr)
+template <class Store, class Flags, byte FRAMES>
+inline void PixelArray<Store, Flags, FRAMES>::setSpan(int first, int count, const COLOR* in)
+{
+  if (!mHaveMem)
   {
-    if (mUseSPI)
-    {
-      SpiRam.read_stream((int *)mMemAddr + (id *csize), (byte*)(&col), csize);
-    }
-    else
-    {
-      col.l = mMemAddr[id].l;
-    }
+    return;
   }
-  return col;
+  TELE_BEGIN(Telemetry::SET);
+  back().write(first, count, in);
+  for (int i=0; i<count; ++i)
+  {
+    flag(first + i);  //Nothing at all for NoFlags.
+  }
+  TELE_END(Telemetry::SET);
 }
 
-void PixelArray::flushFlags()
+/*getWire hands back pixels as the strip wants them: 3 bytes each, green red
+ * blue.  With packed storage that is exactly what's in memory, so it's a
+ * straight copy (or a straight SPI read) with no reordering at all.
+ */
+template <class Store, class Flags, byte FRAMES>
+inline void PixelArray<Store, Flags, FRAMES>::getWire(int first, int count, byte* out)
 {
-  if (mUseUpdateFlags)
+  if (!mHaveMem)
   {
-    int sz = ceil(mNumPix/8);
-    if (mUseSPI)
-    {
-      for (int i=0;i<sz;++i)
-      {
-        SpiRam.write_stream(*mUFAddr + i, 0, 1);
-      }
-    }
-    else
+    memset(out, 0, 3 * count);
+    return;
+  }
+  TELE_BEGIN(Telemetry::GET);
+  front().readWire(first, count, out);
+  TELE_END(Telemetry::GET);
+}
+
+/*sendWire hands the pixels to out.sendByte() one wire byte at a time instead
+ * of through a buffer.  A LitePixel makes a fine Sink: the pixels go straight
+ * from storage to the strip.
+ */
+template <class Store, class Flags, byte FRAMES>
+template <class Sink>
+inline void PixelArray<Store, Flags, FRAMES>::sendWire(int first, int count, Sink& out)
+{
+  if (!mHaveMem)
+  {
+    for (int i=0; i<3 * count; ++i)
     {
-      memset(mUFAddr, 0, sz);
+      out.sendByte(0);
     }
+    return;
   }
+  TELE_BEGIN(Telemetry::STREAM);
+  front().sendWire(first, count, out);
+  TELE_END(Telemetry::STREAM);
 }
 
-byte PixelArray::getFlags(int id)
+template <class Store, class Flags, byte FRAMES>
+inline void PixelArray<Store, Flags, FRAMES>::flush()
 {
-  byte flags = 0xFF; //Return true if not using updateflags.
+  for (byte f=0; f<FRAMES; ++f)
+  {
+    mStore[f].flush();
+  }
+}
 
-  if (mUseUpdateFlags)
+/*The back frame has to be all on the chip before anybody reads it as the
+ * front one straight off the chip.
+ */
+template <class Store, class Flags, byte FRAMES>
+inline void PixelArray<Store, Flags, FRAMES>::swap()
+{
+  back().flush();
+  mFront = (mFront + 1) % FRAMES;
+}
+
+template <class Store, class Flags, byte FRAMES>
+unsigned long PixelArray<Store, Flags, FRAMES>::cacheHits()
+{
+  unsigned long hits = 0;
+  for (byte f=0; f<FRAMES; ++f)
   {
-    int idx1, idx2;
-    idx1 = id/8;
-    idx2 = id%8;
-    //Read bitmask for 8 sequential pixels
-    SpiRam.read_stream(*mUFAddr + idx1, flags, 1);
+    hits += mStore[f].cacheHits();
   }
-  return flags;
+  return hits;
+}
+
+template <class Store, class Flags, byte FRAMES>
+unsigned long PixelArray<Store, Flags, FRAMES>::cacheMisses()
+{
+  unsigned long misses = 0;
+  for (byte f=0; f<FRAMES; ++f)
+  {
+    misses += mStore[f].cacheMisses();
+  }
+  return misses;
+}
+
+template <class Store, class Flags, byte FRAMES>
+void PixelArray<Store, Flags, FRAMES>::flushFlags()
+{
+  mFlags.clear(mNumPix);
+}
+
+template <class Store, class Flags, byte FRAMES>
+byte PixelArray<Store, Flags, FRAMES>::getFlags(int id)
+{
+  return mFlags.get(id);
+}
+
+template <class Store, class Flags, byte FRAMES>
+int PixelArray<Store, Flags, FRAMES>::dirtyCount()
+{
+  return mFlags.count();
+}
+
+template <class Store, class Flags, byte FRAMES>
+int PixelArray<Store, Flags, FRAMES>::nextDirty(int from, int& count, int mergeGap)
+{
+  return mFlags.nextRun(from, count, mergeGap);
 }
 
 #endif //PIXELARRAY_H
@@ -0,0 +1,207 @@
+/*pixmap.h
+ * Which stored pixel each LED on the strip shows.
+ *
+ * Until now LED n showed pix[n], so every LED needed its own stored pixel and
+ * its own step of the rain.  A symmetric installation shows the same pattern
+ * two or four times over, and paying for every copy is a waste of memory we
+ * don't have and of time we'd rather spend on frame rate.  So the strip is
+ * described as a list of segments, in strip order.  Each one takes a run of
+ * stored (logical) pixels and lays it out on the next stretch of LEDs:
+ *
+ *   { first, count, scale, reverse }
+ *   pixels first to first+count-1, each shown on scale LEDs in a row, and
+ *   last to first if reverse.
+ *
+ * So mirroring is the same run twice, the second time reversed; tiling is the
+ * same run several times; stretching is a scale above 1.  Segments may use any
+ * pixels in any order, as long as the LEDs they make add up to the strip.
+ *
+ * The map is applied as the pixels go out, so nothing is stored twice and the
+ * rain only walks the logical pixels.
+ */
+#ifndef PIXMAP_H
+#define PIXMAP_H
+
+struct Segment
+{
+  short first;    //First logical pixel.
+  short count;    //How many logical pixels.
+  byte scale;     //LEDs per logical pixel.
+  bool reverse;   //Last pixel first.
+};
+
+/*What a table of segments adds up to, worked out by the compiler so
+ * CONFIG.h can size the pix array from it and check it against the strip.
+ * (One return statement each, which is all C++11 lets a constexpr have.)
+ */
+constexpr int segmentLeds(const Segment* segs, int n)
+{
+  return n == 0 ? 0 : segs[0].count * segs[0].scale + segmentLeds(segs + 1, n - 1);
+}
+
+constexpr int segmentPix(const Segment* segs, int n)
+{
+  return n == 0 ? 0
+       : segs[0].first + segs[0].count > segmentPix(segs + 1, n - 1) ? segs[0].first + segs[0].count
+       : segmentPix(segs + 1, n - 1);
+}
+
+/*A PixelMap reads its pixels from a PixelArray (Pix) no more than SPAN of
+ * them at a time, the same budget display_pix keeps between two pixels on the
+ * wire (see EMIT_SPAN_PIX in CONFIG.h).
+ */
+template <class Pix, byte SPAN>
+class PixelMap
+{
+public:
+  PixelMap(Pix& pix, const Segment* segs, byte numSegs);
+  void getWire(int led, int count, byte* out);   //GRB bytes for LEDs led to led+count-1.
+  template <class Sink> void sendWire(Sink& out);  //The whole strip to out.sendByte().
+private:
+  void getSegment(const Segment& seg, int off, int count, byte* out);
+  Pix& mPix;
+  const Segment* mSegs;
+  byte mNumSegs;
+};
+
+template <class Pix, byte SPAN>
+PixelMap<Pix, SPAN>::PixelMap(Pix& pix, const Segment* segs, byte numSegs) : mPix(pix),
+                                                                            mSegs(segs),
+                                                                            mNumSegs(numSegs)
+{
+}
+
+/*LEDs off to off+count-1 of one segment.  A plain segment is a straight read.
+ * Otherwise we read the logical pixels those LEDs show, at most SPAN at a
+ * time, and lay each one out as many times as it's shown and in the right
+ * direction.
+ */
+template <class Pix, byte SPAN>
+void PixelMap<Pix, SPAN>::getSegment(const Segment& seg, int off, int count, byte* out)
+{
+  if (seg.scale == 1 && !seg.reverse)
+  {
+    mPix.getWire(seg.first + off, count, out);
+    return;
+  }
+  byte span[SPAN * 3];
+  while (count > 0)
+  {
+    int lo = off / seg.scale;  //Logical pixels, counted along the segment.
+    int hi = (off + count - 1) / seg.scale;
+    if (hi - lo >= SPAN)
+    {
+      hi = lo + SPAN - 1;
+    }
+    int n = hi - lo + 1;
+    mPix.getWire(seg.reverse ? seg.first + seg.count - 1 - hi : seg.first + lo, n, span);
+    for (; count > 0 && off / seg.scale <= hi; ++off, --count)
+    {
+      int i = off / seg.scale - lo;
+      const byte* px = span + 3 * (seg.reverse ? n - 1 - i : i);
+      *out++ = px[0];
+      *out++ = px[1];
+      *out++ = px[2];
+    }
+  }
+}
+
+//Past the last segment is black.
+template <class Pix, byte SPAN>
+void PixelMap<Pix, SPAN>::getWire(int led, int count, byte* out)
+{
+  int base = 0;  //First LED of segment s.
+  for (byte s=0; s<mNumSegs && count > 0; ++s)
+  {
+    int len = mSegs[s].count * mSegs[s].scale;
+    if (led < base + len)
+    {
+      int take = base + len - led;
+      if (take > count)
+      {
+        take = count;
+      }
+      getSegment(mSegs[s], led - base, take, out);
+      out += 3 * take;
+      led += take;
+      count -= take;
+    }
+    base += len;
+  }
+  memset(out, 0, 3 * count);
+}
+
+/*Sits between PixelArray::sendWire and the real Sink and sends every pixel
+ * (3 bytes) scale times over.
+ */
+template <class Sink>
+class RepeatPixels
+{
+public:
+  RepeatPixels(Sink& out, byte scale) : mOut(out), mScale(scale), mHave(0) {}
+  inline void sendByte(byte b);
+private:
+  Sink& mOut;
+  byte mScale;
+  byte mHave;   //Bytes of mPixel so far.
+  byte mPixel[3];
+};
+
+template <class Sink>
+inline void RepeatPixels<Sink>::sendByte(byte b)
+{
+  mPixel[mHave++] = b;
+  if (mHave == 3)
+  {
+    for (byte k=0; k<mScale; ++k)
+    {
+      mOut.sendByte(mPixel[0]);
+      mOut.sendByte(mPixel[1]);
+      mOut.sendByte(mPixel[2]);
+    }
+    mHave = 0;
+  }
+}
+
+/*Forward segments stream straight from storage like an unmapped strip does,
+ * stretched or not.  Reversed ones stream too, a pixel at a time, last first:
+ * each pixel is its own short read that goes straight out as it comes in.  So
+ * the gap between two pixels on the wire holds the start of a read and no
+ * more, the same as at the start of a forward segment, where reading a span of
+ * them in the gap came to about 40us.
+ */
+template <class Pix, byte SPAN>
+template <class Sink>
+void PixelMap<Pix, SPAN>::sendWire(Sink& out)
+{
+  for (byte s=0; s<mNumSegs; ++s)
+  {
+    const Segment& seg = mSegs[s];
+    RepeatPixels<Sink> stretch(out, seg.scale);
+    if (!seg.reverse)
+    {
+      if (seg.scale == 1)
+      {
+        mPix.sendWire(seg.first, seg.count, out);
+      }
+      else
+      {
+        mPix.sendWire(seg.first, seg.count, stretch);
+      }
+      continue;
+    }
+    for (int id=seg.first + seg.count - 1; id>=seg.first; --id)
+    {
+      if (seg.scale == 1)
+      {
+        mPix.sendWire(id, 1, out);
+      }
+      else
+      {
+        mPix.sendWire(id, 1, stretch);
+      }
+    }
+  }
+}
+
+#endif //PIXMAP_H
@@ -0,0 +1,496 @@
+/* pixstore.h
+ *  Where and how PixelArray keeps its pixels.
+ *
+ *  PixelArray used to decide this at run time: every get() and set() asked
+ *  "are we on SPI? are we keeping flags? which flags?" before touching a pixel.
+ *  Those answers never change once the sketch is built, so now they are
+ *  template parameters.  PixelArray<SramStore<ColorLayout> > compiles down to
+ *  plain loads and stores, and none of the SPI code even gets built for it.
+ *
+ *  A layout says how a COLOR turns into bytes.  A store says where those bytes
+ *  live.  CONFIG.h picks one of each from USE_SPI_MEM and USE_PACKED_PIX.
+ */
+#ifndef PIXSTORE_H
+#define PIXSTORE_H
+
+#include "CONFIG.h"
+#include "color.h"
+#include "dirtymap.h"
+#include "telemetry.h"
+#ifdef USE_SPI_MEM
+#include "spi_mem.h"
+#endif
+
+/*ColorLayout stores the whole 4 byte COLOR, spare byte and all.*/
+class ColorLayout
+{
+public:
+  static const int BYTES = 4;
+  static inline COLOR take(const byte* src);
+  static inline void put(byte* dst, COLOR col);
+  static inline void toColors(const byte* src, COLOR* out, int count);
+  static inline void fromColors(byte* dst, const COLOR* in, int count);
+  static inline void toWire(const byte* src, byte* out, int count);
+};
+
+/*WireLayout stores 3 bytes a pixel in the order the strip wants them.*/
+class WireLayout
+{
+public:
+  static const int BYTES = 3;
+  static inline COLOR take(const byte* src);
+  static inline void put(byte* dst, COLOR col);
+  static inline void toColors(const byte* src, COLOR* out, int count);
+  static inline void fromColors(byte* dst, const COLOR* in, int count);
+  static inline void toWire(const byte* src, byte* out, int count);
+};
+
+inline COLOR ColorLayout::take(const byte* src)
+{
+  return *(const COLOR*)src;
+}
+
+inline void ColorLayout::put(byte* dst, COLOR col)
+{
+  *(COLOR*)dst = col;
+}
+
+//src may be the very bytes of out (see SpiStore::busRead), so memmove.
+inline void ColorLayout::toColors(const byte* src, COLOR* out, int count)
+{
+  memmove(out, src, BYTES * count);
+}
+
+inline void ColorLayout::fromColors(byte* dst, const COLOR* in, int count)
+{
+  memcpy(dst, in, BYTES * count);
+}
+
+inline void ColorLayout::toWire(const byte* src, byte* out, int count)
+{
+  for (int i=0; i<count; ++i)
+  {
+    colorToWire(out + i * 3, take(src + i * BYTES));
+  }
+}
+
+inline COLOR WireLayout::take(const byte* src)
+{
+  return wireToColor(src);
+}
+
+inline void WireLayout::put(byte* dst, COLOR col)
+{
+  colorToWire(dst, col);
+}
+
+/*When src is the front of out, COLORs are bigger than what we read, so we fill
+ * out back to front and never write over a byte before we've read it.
+ */
+inline void WireLayout::toColors(const byte* src, COLOR* out, int count)
+{
+  for (int i=count-1; i>=0; --i)
+  {
+    out[i] = wireToColor(src + i * BYTES);
+  }
+}
+
+inline void WireLayout::fromColors(byte* dst, const COLOR* in, int count)
+{
+  for (int i=0; i<count; ++i)
+  {
+    colorToWire(dst + i * BYTES, in[i]);
+  }
+}
+
+inline void WireLayout::toWire(const byte* src, byte* out, int count)
+{
+  memcpy(out, src, BYTES * count);
+}
+
+
+/*SramStore keeps the pixels in arduino memory.
+ * get() and set() don't check for a failed allocation; PixelArray only calls
+ * them when alloc() succeeded.
+ */
+template <class Layout>
+class SramStore
+{
+private:
+  byte* mMem;  //Our pixels, or NULL if alloc() failed.
+public:
+  SramStore() : mMem(NULL) {}
+  ~SramStore() { free(mMem); }
+  bool alloc(int num_pix);
+  inline COLOR get(int id);
+  inline void set(int id, COLOR col);
+  inline void read(int first, int count, COLOR* out);
+  inline void write(int first, int count, const COLOR* in);
+  inline void readWire(int first, int count, byte* out);
+  template <class Sink> inline void sendWire(int first, int count, Sink& out);
+  inline void flush() {}
+  unsigned long cacheHits() { return 0; }
+  unsigned long cacheMisses() { return 0; }
+private:
+  SramStore(const SramStore&);             //No copies: both would free mMem.
+  SramStore& operator=(const SramStore&);
+};
+
+template <class Layout>
+bool SramStore<Layout>::alloc(int num_pix)
+{
+  /*We used to cap this at 256 pixels, which was really a cap of 1K of our 2K
+   * for 4 byte pixels.  The cap is now in bytes (PIX_SRAM_BYTES in CONFIG.h)
+   * so packed 3 byte pixels get the extra room: 388 of them is 1164 bytes.
+   */
+  if ((long)Layout::BYTES * num_pix > PIX_SRAM_BYTES)
+  {
+    return false;  //Too big.
+  }
+  mMem = (byte*)malloc(Layout::BYTES * num_pix);
+  return mMem != NULL;
+}
+
+template <class Layout>
+inline COLOR SramStore<Layout>::get(int id)
+{
+  return Layout::take(mMem + id * Layout::BYTES);
+}
+
+template <class Layout>
+inline void SramStore<Layout>::set(int id, COLOR col)
+{
+  Layout::put(mMem + id * Layout::BYTES, col);
+}
+
+template <class Layout>
+inline void SramStore<Layout>::read(int first, int count, COLOR* out)
+{
+  Layout::toColors(mMem + first * Layout::BYTES, out, count);
+}
+
+template <class Layout>
+inline void SramStore<Layout>::write(int first, int count, const COLOR* in)
+{
+  Layout::fromColors(mMem + first * Layout::BYTES, in, count);
+}
+
+template <class Layout>
+inline void SramStore<Layout>::readWire(int first, int count, byte* out)
+{
+  Layout::toWire(mMem + first * Layout::BYTES, out, count);
+}
+
+template <class Layout>
+template <class Sink>
+inline void SramStore<Layout>::sendWire(int first, int count, Sink& out)
+{
+  byte wire[3];
+  for (int i=0; i<count; ++i)
+  {
+    Layout::toWire(mMem + (first + i) * Layout::BYTES, wire, 1);
+    out.sendByte(wire[0]);
+    out.sendByte(wire[1]);
+    out.sendByte(wire[2]);
+  }
+}
+
+
+#ifdef USE_SPI_MEM
+/*SpiStore keeps the pixels on the SPI RAM chip.
+ * Spans go over the bus as one transaction each.  Single pixels go through a
+ * write-back cache window of PIX_CACHE_PIX pixels kept in arduino memory:
+ * get() and set() work on the window, and the window goes back out over the
+ * bus (only the part that changed) when we move it or flush().
+ */
+template <class Layout>
+class SpiStore
+{
+private:
+  spiMem::SpiAddr mAddr;  //From spi_alloc: the chip address of pixel 0.
+  int mNumPix;
+#if PIX_CACHE_PIX > 0
+  COLOR mCache[PIX_CACHE_PIX];
+  int mCacheFirst;   //Pixel id of mCache[0], or -1 when the window is empty.
+  int mCacheCount;   //Pixels in the window. Less than PIX_CACHE_PIX at the end of the array.
+  DirtyMap mDirty;   //Which pixels in the window changed.
+  unsigned long mCacheHits;
+  unsigned long mCacheMisses;
+#endif
+public:
+  SpiStore();
+  ~SpiStore();
+  bool alloc(int num_pix);
+  inline COLOR get(int id);
+  inline void set(int id, COLOR col);
+  void read(int first, int count, COLOR* out);
+  void write(int first, int count, const COLOR* in);
+  void readWire(int first, int count, byte* out);
+  template <class Sink> void sendWire(int first, int count, Sink& out);
+  void flush();
+  unsigned long cacheHits();
+  unsigned long cacheMisses();
+private:
+  inline spiMem::SpiAddr addr(int id);
+  void busRead(int first, int count, COLOR* out);
+  void busWrite(int first, int count, const COLOR* in);
+  inline void flushOver(int first, int count);
+#if PIX_CACHE_PIX > 0
+  COLOR* cacheFetch(int id);
+#endif
+  SpiStore(const SpiStore&);             //No copies: both would spi_free mAddr.
+  SpiStore& operator=(const SpiStore&);
+};
+
+template <class Layout>
+SpiStore<Layout>::SpiStore() : mAddr(spiMem::SPI_NULL), mNumPix(0)
+{
+#if PIX_CACHE_PIX > 0
+  mCacheFirst = -1;
+  mCacheCount = 0;
+  mDirty.alloc(PIX_CACHE_PIX);
+  mCacheHits = 0;
+  mCacheMisses = 0;
+#endif
+}
+
+template <class Layout>
+bool SpiStore<Layout>::alloc(int num_pix)
+{
+  mNumPix = num_pix;
+  mAddr = spiMem::spi_alloc( (spiMem::SpiAddr)Layout::BYTES * num_pix );
+  return mAddr != spiMem::SPI_NULL;
+}
+
+template <class Layout>
+SpiStore<Layout>::~SpiStore()
+{
+  spiMem::spi_free(mAddr);
+}
+
+/*addr turns a pixel id into a byte address on the SPI RAM chips.  The sum is
+ * done as an SpiAddr: as an int it would overflow past 32K on the board.
+ */
+template <class Layout>
+inline spiMem::SpiAddr SpiStore<Layout>::addr(int id)
+{
+  return mAddr + (spiMem::SpiAddr)id * Layout::BYTES;
+}
+
+//Read count pixels off the chip in one transaction and unpack them in place.
+template <class Layout>
+void SpiStore<Layout>::busRead(int first, int count, COLOR* out)
+{
+  spiMem::spi_read(addr(first), (byte*)out, Layout::BYTES * count);
+  Layout::toColors((byte*)out, out, count);
+}
+
+template <class Layout>
+void SpiStore<Layout>::busWrite(int first, int count, const COLOR* in)
+{
+  if (Layout::BYTES == sizeof(COLOR))  //Decided by the compiler, not at run time.
+  {
+    spiMem::spi_write(addr(first), (const byte*)in, Layout::BYTES * count);
+    return;
+  }
+  byte packed[16 * Layout::BYTES];  //Pack a few at a time; we can't pack in place.
+  while (count > 0)
+  {
+    int n = count < 16 ? count : 16;
+    Layout::fromColors(packed, in, n);
+    spiMem::spi_write(addr(first), packed, Layout::BYTES * n);
+    first += n;
+    in += n;
+    count -= n;
+  }
+}
+
+template <class Layout>
+inline COLOR SpiStore<Layout>::get(int id)
+{
+#if PIX_CACHE_PIX > 0
+  return *cacheFetch(id);
+#else
+  COLOR col;
+  busRead(id, 1, &col);
+  return col;
+#endif
+}
+
+template <class Layout>
+inline void SpiStore<Layout>::set(int id, COLOR col)
+{
+#if PIX_CACHE_PIX > 0
+  COLOR* slot = cacheFetch(id);
+  *slot = col;
+  mDirty.mark(slot - mCache);  //Position in the window.
+#else
+  busWrite(id, 1, &col);
+#endif
+}
+
+#if PIX_CACHE_PIX > 0
+/*cacheFetch returns where pixel id lives in the cache window, moving the
+ * window there first if it has to.  Windows always start on a multiple of
+ * PIX_CACHE_PIX, so a sweep through the array fills each window with one
+ * burst read and empties it with (at most) one burst write.
+ */
+template <class Layout>
+COLOR* SpiStore<Layout>::cacheFetch(int id)
+{
+  if (mCacheFirst >= 0 && id >= mCacheFirst && id < mCacheFirst + mCacheCount)
+  {
+    ++mCacheHits;
+  }
+  else
+  {
+    ++mCacheMisses;
+    flush();
+    mCacheFirst = id - id % PIX_CACHE_PIX;
+    mCacheCount = mNumPix - mCacheFirst;
+    if (mCacheCount > PIX_CACHE_PIX)
+    {
+      mCacheCount = PIX_CACHE_PIX;
+    }
+    busRead(mCacheFirst, mCacheCount, mCache);
+  }
+  return mCache + (id - mCacheFirst);
+}
+#endif
+
+template <class Layout>
+void SpiStore<Layout>::flush()
+{
+#if PIX_CACHE_PIX > 0
+  //Only the pixels that changed, a burst per run of them.
+  int n;
+  for (int w=mDirty.nextRun(0, n, WRITE_MERGE_PIX); w>=0; w=mDirty.nextRun(w+n, n, WRITE_MERGE_PIX))
+  {
+    busWrite(mCacheFirst + w, n, mCache + w);
+  }
+  mDirty.clear();
+#endif
+}
+
+//Before reading the chip directly, write out any cached changes in that range.
+template <class Layout>
+inline void SpiStore<Layout>::flushOver(int first, int count)
+{
+#if PIX_CACHE_PIX > 0
+  if (mDirty.any() && first < mCacheFirst + mCacheCount && first + count > mCacheFirst)
+  {
+    flush();  //The chip is behind the cache for some of these pixels.
+  }
+#endif
+}
+
+template <class Layout>
+void SpiStore<Layout>::read(int first, int count, COLOR* out)
+{
+  flushOver(first, count);
+  busRead(first, count, out);
+}
+
+template <class Layout>
+void SpiStore<Layout>::write(int first, int count, const COLOR* in)
+{
+  busWrite(first, count, in);
+#if PIX_CACHE_PIX > 0
+  //Keep the cache window in step with what we just wrote around it.
+  if (mCacheFirst >= 0 && first < mCacheFirst + mCacheCount && first + count > mCacheFirst)
+  {
+    for (int i=0; i<count; ++i)
+    {
+      int w = first + i - mCacheFirst;
+      if (w >= 0 && w < mCacheCount)
+      {
+        mCache[w] = in[i];
+      }
+    }
+  }
+#endif
+}
+
+/*Packed pixels are already wire bytes, so they come straight off the chip.
+ * Whole COLORs come across a few at a time and get reordered here.
+ */
+template <class Layout>
+void SpiStore<Layout>::readWire(int first, int count, byte* out)
+{
+  flushOver(first, count);
+  if (Layout::BYTES == 3)
+  {
+    spiMem::spi_read(addr(first), out, 3 * count);
+    return;
+  }
+  COLOR col[4];
+  while (count > 0)
+  {
+    int n = count < 4 ? count : 4;
+    busRead(first, n, col);
+    for (int i=0; i<n; ++i)
+    {
+      colorToWire(out + i * 3, col[i]);
+    }
+    first += n;
+    out += n * 3;
+    count -= n;
+  }
+}
+
+/*sendWire streams count pixels off the chip in one transaction (one more per
+ * chip boundary it crosses), a byte at a time into out.sendByte().  No span
+ * reads in the gaps between pixels, so the gap is one byte of SPI and the
+ * frame is one chip-select instead of one per EMIT_SPAN_PIX pixels.  Packed pixels go out in the order they come in.  A
+ * 4 byte COLOR comes in red, green, blue, spare, so red waits for green.
+ */
+template <class Layout>
+template <class Sink>
+void SpiStore<Layout>::sendWire(int first, int count, Sink& out)
+{
+  flush();  //The chip has to be up to date before we read it behind the cache.
+  spiMem::streamBegin(addr(first));
+  TELE_ADD(Telemetry::SPI_BYTES, Layout::BYTES * count);  //The command and address count themselves.
+  if (Layout::BYTES == 3)
+  {
+    for (int i=0; i<3 * count; ++i)
+    {
+      out.sendByte(spiMem::streamNext());
+    }
+  }
+  else
+  {
+    for (int i=0; i<count; ++i)
+    {
+      byte r = spiMem::streamNext();
+      out.sendByte(spiMem::streamNext());  //Green
+      out.sendByte(r);
+      out.sendByte(spiMem::streamNext());  //Blue
+      spiMem::streamNext();  //Spare
+    }
+  }
+  spiMem::streamEnd();
+}
+
+template <class Layout>
+unsigned long SpiStore<Layout>::cacheHits()
+{
+#if PIX_CACHE_PIX > 0
+  return mCacheHits;
+#else
+  return 0;
+#endif
+}
+
+template <class Layout>
+unsigned long SpiStore<Layout>::cacheMisses()
+{
+#if PIX_CACHE_PIX > 0
+  return mCacheMisses;
+#else
+  return 0;
+#endif
+}
+#endif //USE_SPI_MEM
+
+#endif //PIXSTORE_H
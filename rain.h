@@ -6,6 +6,10 @@
 
 #include "color.h"
 #include "CONFIG.h"
+#include "fastrand.h"
+#include "dirtymap.h"
+#include "telemetry.h"
+#include "capture.h"
 
 using namespace CONFIG;
 
@@ -16,26 +20,196 @@ public:   //public variables.
   int mShiftOdds; //The 1 in n odds of picking a new hue mask.
 public:   //public functions.
   Rain(); //Default constructor
-  void loopStep();  //Per frame call from loop.
+  void setup();     //Call once the pixels are in place, before the first loopStep.
+  void loopStep();  //Per frame call from loop.  Steps every pixel.
+  int step(int maxPix);  //Step up to maxPix pixels on from where the last step stopped.
+  bool draining();  //True while any channel outside the hue mask is still lit.
+  void seed(uint32_t seed);  //Restart the random sequence; same seed, same rain.
+  byte hueMask() { return mHueMask; }
+  uint32_t randState() { return mRand.state(); }  //Where the random sequence is up to.
+  void resume(byte hueMask, uint32_t seed);  //Back to a hueMask() and randState() saved earlier.
+
+  /*The same step, a pixel at a time, for stream_pix (see stream.h).
+   * beginFrame, then pixel(id) for every id in order, then endFrame.
+   */
+  void beginFrame();
+  inline COLOR pixel(int id);
+  void endFrame();
+  bool idle();      //A little deferred work, for LitePixel::waitLatch.
+  /*The longest pixel() takes: a span read in or written back (never both)
+   * and one step of the walk, about 100 cycles or 6us.  The write back is a
+   * burst per run of changed pixels, and runs more than WRITE_MERGE_PIX apart
+   * stay apart, so a span holds at most WRITE_RUNS of them.  Whichever of the
+   * read and the write costs more.
+   */
+  static const int WRITE_RUNS = (CONFIG::EMIT_SPAN_PIX + WRITE_MERGE_PIX + 1) / (WRITE_MERGE_PIX + 2);
+  static const int WRITE_US = WRITE_RUNS * CONFIG::BURST_US +
+                              (CONFIG::EMIT_SPAN_PIX - (WRITE_RUNS - 1) * (WRITE_MERGE_PIX + 1)) * CONFIG::PIX_US;
+  static const int PIXEL_US = 6 + (WRITE_US > CONFIG::SPAN_READ_US ? WRITE_US : CONFIG::SPAN_READ_US);
 private:
   byte pickHueMask();   //Get a new hue mask
-  byte walkPixels();    //The math of the shimmer.
+  void walkPixels(int from, int count);  //The math of the shimmer.
+  void census();        //Count lit pixels per channel the slow way.
+  void walkPixel(COLOR& col);  //One step of the shimmer for one pixel.
+  void laneMasks();     //Work out mOnLanes and mDrainLanes from mHueMask and mLit.
+  void countLanes(uint32_t born, uint32_t died);  //SWAR walk's mLit bookkeeping.
+  void shiftHue();      //Maybe pick a new hue mask, once the old one has drained.
+  void endSweep();      //Every pixel in range of a step; on to the next phase.
+  void flushSpan();     //Write back what pixel() changed in mSpan.
+  void writeChanged(int first, const COLOR* span);  //Write back the runs in mChanged.
 private:  //class private variables
+  FastRand mRand; //Our coin tosses.  See fastrand.h
+  int mCursor;    //Where the next step() starts.
+  byte mPhase;    //Which pixels of each WALK_STRIDE this sweep steps.
+  byte mSkip;     //pixel(): pixels to go before the next one we step.
   byte mHueMask;  //Which bits are active on this iteration.
-  bool mDirty;    //Set to true when any RGB not in current set is set for any pixel in chain.
+  /*mLit[c] is how many pixels have channel c above 0.  A lit channel never
+   * steps down to 0 and a draining one never steps up from it, so we only
+   * have to count the moment a value crosses 0 to keep these exact.
+   */
+  int mLit[3];
+  byte mDrainMask;     //Channels outside mHueMask with mLit above 0.
+  uint32_t mOnLanes;   //0x80 in each byte of a COLOR whose channel is in mHueMask.
+  uint32_t mDrainLanes;  //0x80 in each byte of a COLOR whose channel is in mDrainMask.
+
+  /*pixel() works through the strip a span at a time like walkPixels does,
+   * but the span lives here between calls.  Spans are EMIT_SPAN_PIX long
+   * because the read and write back happen in the display's inter-pixel gap.
+   */
+  COLOR mSpan[CONFIG::EMIT_SPAN_PIX];
+  int mSpanFirst;  //Pixel id of mSpan[0].
+  int mSpanCount;  //How many of mSpan are loaded.
+
+  DirtyMap mChanged;  //Which pixels of the span we're on changed.  Either kind of span.
 };
 
-Rain::Rain() : mDirty(false),
-               mShiftOdds(200)  //TODO: Setting arbitrary inline const is ugly
+Rain::Rain() : mShiftOdds(200),  //TODO: Setting arbitrary inline const is ugly
+               mCursor(0),
+               mPhase(0),
+               mSkip(0),
+               mSpanFirst(0),
+               mSpanCount(0)
+{
+  mHueMask = pickHueMask();
+  mLit[0] = mLit[1] = mLit[2] = 0;
+  mChanged.alloc(CONFIG::SPAN_PIX > CONFIG::EMIT_SPAN_PIX ? CONFIG::SPAN_PIX : CONFIG::EMIT_SPAN_PIX);
+}
+
+void Rain::setup()
+{
+  census();
+}
+
+/*Whatever was in memory when we powered up is what we start from, so the
+ * counts have to come from looking at every pixel once.  After this the walk
+ * keeps them up to date as it goes.
+ */
+void Rain::census()
+{
+  COLOR span[CONFIG::SPAN_PIX];
+  mLit[0] = mLit[1] = mLit[2] = 0;
+  for (int first=0; first<CONFIG::NUM_PIX; first+=CONFIG::SPAN_PIX)
+  {
+    int count = CONFIG::NUM_PIX - first;
+    if (count > CONFIG::SPAN_PIX)
+    {
+      count = CONFIG::SPAN_PIX;
+    }
+    CONFIG::pix.getSpan(first, count, span);
+    for (int p=0;p<count;++p)
+    {
+      for (int c=0;c<3;++c)
+      {
+        if (span[p].c[c])
+        {
+          ++mLit[c];
+        }
+      }
+    }
+  }
+}
+
+//The old way to know this was to walk every pixel and see.  Now it's a lookup.
+bool Rain::draining()
 {
+  for (int c=0;c<3;++c)
+  {
+    if ( !((mHueMask >> c) & 1) && mLit[c] > 0 )
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+void Rain::seed(uint32_t seed)
+{
+  mRand.seed(seed);
   mHueMask = pickHueMask();
 }
 
+/*The pixels come back first (see snapshot.h), then this, then setup() counts
+ * them as usual.
+ */
+void Rain::resume(byte hueMask, uint32_t seed)
+{
+  mRand.seed(seed);
+  mHueMask = hueMask;
+}
+
 void Rain::loopStep()
 {
-  if (!walkPixels())
+  step(CONFIG::NUM_PIX);
+}
+
+/*When there isn't time to step the whole strip in a frame (see scheduler.h)
+ * we step part of it and carry on from there next frame.  The hue only gets
+ * a chance to change once every pixel has had its step, so the odds of a
+ * change stay per sweep no matter how many frames a sweep takes, nor how many
+ * phases of WALK_STRIDE it takes to reach every pixel.
+ * The count returned is the pixels the step went over, stepped or not.
+ * A back frame has to be written whole every frame, so with two frames it's
+ * always the whole strip.
+ */
+int Rain::step(int maxPix)
+{
+  if (CONFIG::pix.doubleBuffered())
+  {
+    maxPix = CONFIG::NUM_PIX;
+  }
+  int count = CONFIG::NUM_PIX - mCursor;
+  if (count > maxPix)
+  {
+    count = maxPix;
+  }
+  walkPixels(mCursor, count);
+  mCursor += count;
+  if (mCursor >= CONFIG::NUM_PIX)
+  {
+    mCursor = 0;
+    endSweep();
+  }
+  return count;
+}
+
+/*The hue may only change once every phase has been stepped.  The counts in
+ * mLit are kept by the pixels we step, and the ones we skip don't change, so
+ * they're right after any phase and draining() can be asked at any time.
+ */
+void Rain::endSweep()
+{
+  if (++mPhase >= WALK_STRIDE)
+  {
+    mPhase = 0;
+    shiftHue();
+  }
+}
+
+void Rain::shiftHue()
+{
+  if (!draining())
   {
-    if (!random(mShiftOdds))
+    if (mRand.oneIn(mShiftOdds))
     {
       mHueMask = pickHueMask();
     }
@@ -67,7 +241,7 @@ byte Rain::pickHueMask()
    * 7 111 white     red+green+blue
    */
   
-  byte cbits=random(5)+2;  //generate value from 2-6
+  byte cbits=mRand.below(5)+2;  //generate value from 2-6
 
    /*Now let's create the rare opportunity for red.  We'll do this by inverting the bitmask
     * when our random value is 0.  if the color happens to be cyan, it will be flipped to 
@@ -75,7 +249,7 @@ byte Rain::pickHueMask()
     * color generated above is 110 (cyan)
     */
 
-  if (!random(5))  //If 0, invert the bitmask.
+  if (!mRand.below(5))  //If 0, invert the bitmask.
   {
     cbits = ~cbits;  // ~ is the complimentary operator 010 becomes 101 etc
   }
@@ -83,70 +257,308 @@ byte Rain::pickHueMask()
 }
 
 //Iterate through pixels and stagger around in the relative color space. 
-byte Rain::walkPixels()
+void Rain::walkPixels(int from, int count)
 {
-  mDirty=false;
-  for (int p=0;p<CONFIG::NUM_LEDS; ++p)  //Loop through pixels.
+  COLOR span[CONFIG::SPAN_PIX];  //Local copy of the pixels we're working on.
+
+  TELE_BEGIN(Telemetry::WALK);
+  laneMasks();
+  /*Rather than get() and set() each pixel on its own, pull a span of them
+   * across in one burst, walk them here, and push back only the pixels that
+   * actually changed.
+   */
+  int end = from + count;
+  for (int first=from; first<end; first+=CONFIG::SPAN_PIX)  //Loop through spans.
   {
-    COLOR col = CONFIG::pix.get(p);
-    long ocol = col.l;
-    
-    for (int c=0;c<3;++c)     //Loop through RBG sub-pixels of each pixel.
+    int n = end - first;
+    if (n > CONFIG::SPAN_PIX)
     {
-      /*in pickHueMask we set mHueMask to the subset of LEDs in a pixel we want to touch
-       * (mHueMask >> c) means 'bitshift the value of mHueMask right by c bits. 
-       * For example, recall that bits are powers of 2.  IE 2^0=1, 2^1=2, 2^2=4, 2^3=8
-       * >> simply moves all the bits in a word one to the right. 8 becomes 4, 4 2, etc. 
-       * whatever was in the 1's column is thrown away. If you have a number like 
-       * 23 (binary 10111) >> 2 the result is: 101 (5 decimal) 
-       * We then & with 1 to see if this Hue is to be lit.  
-       * if ( mHueMask & (1<<c) ) is functionally identical but shifts the comparator val 
-       * instead.
-       */
-      if ( (mHueMask >> c) & 1 )
+      n = CONFIG::SPAN_PIX;
+    }
+    /*With a WALK_STRIDE we only step this phase's pixels, so we only read from
+     * the first of them to the last.  A back frame needs every pixel copied
+     * across, stepped or not, so it gets the whole span.
+     */
+    int skip = (mPhase + WALK_STRIDE - first % WALK_STRIDE) % WALK_STRIDE;  //Span's first pixel to step.
+    int read = 0;  //Span's first pixel to read.
+    if (!CONFIG::pix.doubleBuffered())
+    {
+      if (skip >= n)
       {
-          /*Now we need to decide if this individual LED is going to step forward, backwards
-           * or stay where it is.  I've done this by using random(3)-1 which produces 
-           * either -1, 0, or 1 as its output. and simply added it to the value of the 
-           * hue.  Note that my value is a signed int (2 bytes) whereas hues are 
-           * (unsigned) byte.  Our result can be outside the range of the byte (256 or -1) 
-           * so we use the extra space of the signed integer to absorb this, then range check
-           * and only adopt valid range values. 
-           */
-          signed int val = col.c[c] + (random(3) - 1); // rand result set [0,1,2] - 1 = [-1, 0, 1]
-          if (val > 0 && val < 255)
+        continue;  //None of this phase's pixels here.
+      }
+      read = skip;
+      n = (n - 1 - skip) / WALK_STRIDE * WALK_STRIDE + 1;  //Up to this phase's last.
+      skip = 0;
+    }
+    CONFIG::pix.getSpan(first + read, n, span);
+
+    for (int p=0;p<n; ++p)  //Loop through pixels.
+    {
+      uint32_t ocol = span[p].l;
+      if (p == skip)
+      {
+        walkPixel(span[p]);
+        skip += WALK_STRIDE;
+      }
+      //Only write pixel to mem if actually changed.  A back frame needs them all.
+      if (span[p].l != ocol || CONFIG::pix.doubleBuffered())
+      {
+        mChanged.mark(p);
+        CAPTURE_PIXEL(first + read + p, ocol, span[p].l);
+      }
+    }
+    writeChanged(first + read, span);
+    CAPTURE_PUMP();  //Not from writeChanged: stream_pix calls that between pixels on the wire.
+  } //End loop through spans.
+  TELE_END(Telemetry::WALK);
+}
+
+/*A burst per run of changed pixels, letting runs bridge WRITE_MERGE_PIX
+ * unchanged ones (see CONFIG.h).
+ */
+void Rain::writeChanged(int first, const COLOR* span)
+{
+  int n;
+  TELE_ADD(Telemetry::CHANGED, mChanged.count());
+  for (int p=mChanged.nextRun(0, n, WRITE_MERGE_PIX); p>=0; p=mChanged.nextRun(p+n, n, WRITE_MERGE_PIX))
+  {
+    CONFIG::pix.setSpan(first + p, n, span + p);
+  }
+  mChanged.clear();
+}
+
+/*The first span is read here, before stream_pix waits out the last latch,
+ * rather than in the gap before the first pixel.
+ */
+void Rain::beginFrame()
+{
+  laneMasks();
+  mChanged.clear();
+  mSkip = mPhase;
+  mSpanFirst = 0;
+  mSpanCount = CONFIG::NUM_PIX < CONFIG::EMIT_SPAN_PIX ? CONFIG::NUM_PIX : CONFIG::EMIT_SPAN_PIX;
+  CONFIG::pix.getSpan(0, mSpanCount, mSpan);
+}
+
+/*One pixel of walkPixels.  The first pixel of each span reads the span in
+ * and the last one writes it back, so no single call ever does both; those two
+ * are the slow calls and what set the gap stream_pix leaves on the wire.  The
+ * random draws come in the same order as walkPixels takes them, so both ways
+ * make the same rain.
+ */
+inline COLOR Rain::pixel(int id)
+{
+  int p = id - mSpanFirst;
+  if (p >= mSpanCount)
+  {
+    flushSpan();
+    mSpanFirst = id;
+    mSpanCount = CONFIG::NUM_PIX - id;
+    if (mSpanCount > CONFIG::EMIT_SPAN_PIX)
+    {
+      mSpanCount = CONFIG::EMIT_SPAN_PIX;
+    }
+    CONFIG::pix.getSpan(mSpanFirst, mSpanCount, mSpan);
+    p = 0;
+  }
+  uint32_t ocol = mSpan[p].l;
+  if (mSkip == 0)  //A countdown: a % per pixel is a division on the AVR.
+  {
+    walkPixel(mSpan[p]);
+    mSkip = WALK_STRIDE;
+  }
+  --mSkip;
+  if (mSpan[p].l != ocol || CONFIG::pix.doubleBuffered())
+  {
+    mChanged.mark(p);
+    CAPTURE_PIXEL(id, ocol, mSpan[p].l);
+  }
+  if (p == mSpanCount - 1)
+  {
+    flushSpan();
+  }
+  return mSpan[p];
+}
+
+void Rain::flushSpan()
+{
+  writeChanged(mSpanFirst, mSpan);
+}
+
+//Get random words made ahead while the strip latches.
+bool Rain::idle()
+{
+  return mRand.prefill();
+}
+
+void Rain::endFrame()
+{
+  flushSpan();
+  endSweep();
+}
+
+/*Channels that are out of the hue mask and already 0 everywhere have nothing
+ * left to drain, so the walk leaves them out entirely.
+ */
+void Rain::laneMasks()
+{
+  mOnLanes = 0;
+  mDrainLanes = 0;
+  mDrainMask = 0;
+  for (int c=0;c<3;++c)
+  {
+    if ( (mHueMask >> c) & 1 )
+    {
+      mOnLanes |= 0x80UL << (8 * c);
+    }
+    else if (mLit[c] > 0)
+    {
+      mDrainLanes |= 0x80UL << (8 * c);
+      mDrainMask |= 1 << c;
+    }
+  }
+}
+
+//born and died have 0x80 set in the byte of each channel that crossed 0.
+void Rain::countLanes(uint32_t born, uint32_t died)
+{
+  for (int c=0;c<3;++c)
+  {
+    if ( (born >> (8 * c + 7)) & 1 )
+    {
+      ++mLit[c];
+    }
+    if ( (died >> (8 * c + 7)) & 1 )
+    {
+      --mLit[c];
+    }
+  }
+}
+
+#ifdef USE_SWAR_WALK
+/*SWAR ("SIMD within a register") helpers.  A COLOR is 4 bytes in a 32 bit
+ * word, so with care we can do the same thing to R, G and B in one go.  The
+ * care is all about never letting a carry or borrow spill from one byte into
+ * the next.  Each helper answers its question for every channel at once by
+ * setting the top bit (0x80) of that channel's byte.  Byte 3, the spare, is
+ * never touched.
+ */
+#define SWAR_LO 0x00010101UL  //1 in each channel byte.
+#define SWAR_HI 0x00808080UL  //0x80 in each channel byte.
+#define SWAR_7F 0x007F7F7FUL
+
+//Which bytes of v are non zero.  Adding 0x7F to the low 7 bits carries into
+//the top bit unless they were all 0; OR-ing v catches the top bit itself.
+static inline uint32_t swarNonZero(uint32_t v)
+{
+  return (((v & SWAR_7F) + SWAR_7F) | v) & SWAR_HI;
+}
+
+//Which bytes of v are less than k (k no more than 128).  Setting each top bit
+//first means no byte can borrow from its neighbour when we subtract k.
+static inline uint32_t swarLess(uint32_t v, byte k)
+{
+  return ~(((v | SWAR_HI) - k * SWAR_LO) | v) & SWAR_HI;
+}
+#endif
+
+//Take one random step for each RGB sub-pixel of col.
+void Rain::walkPixel(COLOR& col)
+{
+  /*One 32 bit draw covers the whole pixel: byte c of it is the coin toss for
+   * sub-pixel c.  See fastrand.h
+   */
+  uint32_t lanes = mRand.lanes();
+#ifdef USE_SWAR_WALK
+  /*The same rules as the loop below, for all three channels at once and with
+   * no branches.  Given the same lanes it gives exactly the same answer.
+   *  Lit channels step up if the toss says so and they're at most 253, 
+   *  step down if the toss says so and they're at least 2.
+   *  Unlit channels that aren't 0 yet drain by 1 on a 1 in 5 toss.
+   */
+  uint32_t x = col.l;
+  uint32_t up = swarLess(~lanes, 256 - FastRand::TRIT_UP);  //lane >= TRIT_UP
+  uint32_t down = swarLess(lanes, FastRand::TRIT_DOWN);
+  uint32_t drain = swarLess(lanes, FastRand::DRAIN_ODDS);
+  uint32_t lit = swarNonZero(x) & mDrainLanes;         //Unlit channel still lit.
+  uint32_t inc = up & swarNonZero(~x & 0xFEFEFEUL) & mOnLanes;
+  uint32_t dec = (down & swarNonZero(x & 0xFEFEFEUL) & mOnLanes) | (drain & lit);
+  col.l = x + (inc >> 7) - (dec >> 7);  //Each byte gets +1, -1 or 0; none can wrap.
+  uint32_t born = inc & ~swarNonZero(x);               //Was 0, now 1.
+  uint32_t died = drain & lit & ~swarNonZero(x ^ SWAR_LO);  //Was 1, now 0.
+  if (born | died)
+  {
+    countLanes(born, died);
+  }
+#ifdef HOST_SIM
+  ++Sim::stats.walkOps;
+#endif
+#else
+  for (int c=0;c<3;++c)     //Loop through RBG sub-pixels of each pixel.
+  {
+    byte lane = (byte)(lanes >> (8 * c));
+    /*in pickHueMask we set mHueMask to the subset of LEDs in a pixel we want to touch
+     * (mHueMask >> c) means 'bitshift the value of mHueMask right by c bits. 
+     * For example, recall that bits are powers of 2.  IE 2^0=1, 2^1=2, 2^2=4, 2^3=8
+     * >> simply moves all the bits in a word one to the right. 8 becomes 4, 4 2, etc. 
+     * whatever was in the 1's column is thrown away. If you have a number like 
+     * 23 (binary 10111) >> 2 the result is: 101 (5 decimal) 
+     * We then & with 1 to see if this Hue is to be lit.  
+     * if ( mHueMask & (1<<c) ) is functionally identical but shifts the comparator val 
+     * instead.
+     */
+#ifdef HOST_SIM
+    if ( ((mHueMask | mDrainMask) >> c) & 1 )
+    {
+      ++Sim::stats.walkOps;
+    }
+#endif
+    if ( (mHueMask >> c) & 1 )
+    {
+        /*Now we need to decide if this individual LED is going to step forward, backwards
+         * or stay where it is.  I've done this by using FastRand::trit which produces 
+         * either -1, 0, or 1 as its output. and simply added it to the value of the 
+         * hue.  Note that my value is a signed int (2 bytes) whereas hues are 
+         * (unsigned) byte.  Our result can be outside the range of the byte (256 or -1) 
+         * so we use the extra space of the signed integer to absorb this, then range check
+         * and only adopt valid range values. 
+         */
+        signed int val = col.c[c] + FastRand::trit(lane); // [-1, 0, 1]
+        if (val > 0 && val < 255)
+        {
+          if (col.c[c] == 0)
           {
-            col.c[c] = val;  //Stagger around in the relative color space.
+            ++mLit[c];  //Just came on.
           }
-      }
-      else
-      {                       //Stagger towards 0, let iterator know this one doesn't count. 
-        if (col.c[c] > 0) //This RGB should not be set in this hue. Still draining previous color
+          col.c[c] = val;  //Stagger around in the relative color space.
+        }
+    }
+    else if ( (mDrainMask >> c) & 1 )  //Skip channels with nothing left to drain.
+    {                       //Stagger towards 0, let iterator know this one doesn't count. 
+      if (col.c[c] > 0) //This RGB should not be set in this hue. Still draining previous color
+      {
+        /*Initially I had simply pix.get(p).c[c] -= random(2); (50/50 chance of darkening) 
+         * but decided this moved to 0 too quickly and played around to find a chance 
+         * to descend that was more visually appealing to me. 
+         */
+        if (FastRand::drain(lane))  //1 in 5
         {
-          mDirty=true;  //Indicates some pixels of the skipped hue are still set. 
-          /*Initially I had simply pix.get(p).c[c] -= random(2); (50/50 chance of darkening) 
-           * but decided this moved to 0 too quickly and played around to find a chance 
-           * to descend that was more visually appealing to me. 
+          /*TODO: This is a bit uglier than our previous interface of 
+           * simply -- Let's leave this for the moment.  If we find later
+           * that we're doing a lot of math directly on elements, we might
+           * consider writing some operator overloads to handle this.
            */
-          if (!random(5))
+          col.c[c] --;                    //Subtract
+          if (col.c[c] == 0)
           {
-            /*TODO: This is a bit uglier than our previous interface of 
-             * simply -- Let's leave this for the moment.  If we find later
-             * that we're doing a lot of math directly on elements, we might
-             * consider writing some operator overloads to handle this.
-             */
-            col.c[c] --;                    //Subtract
+            --mLit[c];  //Finished draining.
           }
         }
       }
-    } //End RGB iteration of this pixel
-    if (col.l != ocol )  //Only write pixel to mem if actually changed. 
-    {
-      CONFIG::pix.set(p,col);
     }
-  } //End loop through arrays.
-  return mDirty;
+  } //End RGB iteration of this pixel
+#endif //USE_SWAR_WALK
 }
 
-
 #endif //RAIN_H
@@ -0,0 +1,175 @@
+/*scheduler.h
+ * Keep frames coming at a steady rate.
+ *
+ * Left to itself loop() runs flat out, so how fast the rain moves depends on
+ * how long the strip is, how much SPI it needs and which hue we're in.  The
+ * FrameScheduler gives every frame the same length: it times each stage of
+ * the frame with micros(), tells the rain how many pixels it has time to step,
+ * and waits out whatever is left of the frame at the end.  A frame that
+ * overruns anyway is counted as missed.
+ *
+ *   sched.beginFrame();
+ *   int n = rain.step(sched.stepBudget(NUM_PIX));
+ *   sched.endStage(FrameScheduler::STEP, n);
+ *   ... wait for the latch ...    sched.endStage(FrameScheduler::LATCH);
+ *   ... send the frame ...        sched.endStage(FrameScheduler::EMIT);
+ *   sched.endFrame();
+ */
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "color.h"
+
+class FrameScheduler
+{
+public:
+  enum Stage { STEP, LATCH, EMIT, STAGES };
+
+  /*However short of time we are, every pixel gets a step at least once in
+   * this many frames.  Below that the rain would all but stop.
+   */
+  static const byte MAX_SKIP = 8;
+
+  FrameScheduler(uint16_t fps);
+  void setTarget(uint16_t fps);  //Frames a second.  0 runs flat out, every pixel every frame.
+  void beginFrame();
+  void endStage(byte stage);               //The stage that just finished.
+  void endStage(byte stage, int pixels);   //STEP: and how many pixels it stepped.
+  int stepBudget(int numPix);              //How many pixels the step has time for.
+  void endFrame();                         //Wait for the next frame's turn.
+  template <class Idle> void endFrame(Idle& idle);  //Call idle.idle() in the wait, while it has work.
+
+  unsigned long frames() { return mFrames; }
+  unsigned long missed() { return mMissed; }  //Frames that ran over.
+  unsigned long stageLast(byte stage) { return mLast[stage]; }  //us
+  unsigned long stageMax(byte stage) { return mMax[stage]; }    //us
+private:
+  unsigned long mPeriod;      //us per frame, 0 for flat out.
+  unsigned long mFrameStart;  //micros() at beginFrame.
+  unsigned long mStageStart;  //micros() when the current stage began.
+  unsigned long mLast[STAGES];
+  unsigned long mMax[STAGES];
+  unsigned long mPixCost;     //Step time per 16 pixels, us.  0 until we've measured it.
+  unsigned long mFrames;
+  unsigned long mMissed;
+};
+
+FrameScheduler::FrameScheduler(uint16_t fps) : mFrameStart(0),
+                                               mStageStart(0),
+                                               mPixCost(0),
+                                               mFrames(0),
+                                               mMissed(0)
+{
+  setTarget(fps);
+  for (byte s=0; s<STAGES; ++s)
+  {
+    mLast[s] = 0;
+    mMax[s] = 0;
+  }
+}
+
+void FrameScheduler::setTarget(uint16_t fps)
+{
+  mPeriod = fps ? 1000000UL / fps : 0;
+}
+
+void FrameScheduler::beginFrame()
+{
+  mFrameStart = micros();
+  mStageStart = mFrameStart;
+}
+
+void FrameScheduler::endStage(byte stage)
+{
+  unsigned long now = micros();
+  mLast[stage] = now - mStageStart;
+  if (mLast[stage] > mMax[stage])
+  {
+    mMax[stage] = mLast[stage];
+  }
+  mStageStart = now;
+}
+
+/*The step's cost per pixel is what the budget is worked out from.  It
+ * wanders with the hue (a draining channel costs more) so it's smoothed:
+ * each new measure counts for a quarter.
+ */
+void FrameScheduler::endStage(byte stage, int pixels)
+{
+  endStage(stage);
+  if (pixels > 0)
+  {
+    unsigned long cost = mLast[stage] * 16 / pixels;
+    mPixCost = mPixCost ? (mPixCost * 3 + cost) / 4 : cost;
+  }
+}
+
+/*Whatever the frame doesn't spend latching and sending is the step's, less
+ * an eighth to spare.  Latch and send take much the same time every frame, so
+ * last frame's are a good guess at this frame's.
+ */
+int FrameScheduler::stepBudget(int numPix)
+{
+  if (mPeriod == 0 || mPixCost == 0)
+  {
+    return numPix;  //Flat out, or we don't know the cost yet.
+  }
+  long spare = (long)(mPeriod - mPeriod / 8) - (long)(mLast[LATCH] + mLast[EMIT]);
+  long pixels = spare > 0 ? spare * 16 / (long)mPixCost : 0;
+  long least = (numPix + MAX_SKIP - 1) / MAX_SKIP;
+  if (pixels < least)
+  {
+    pixels = least;
+  }
+  if (pixels > numPix)
+  {
+    pixels = numPix;
+  }
+  return pixels;
+}
+
+/*delay() and delayMicroseconds() rather than a spin on micros(): on the
+ * board it's the same wait, and the host build doesn't sit through it.
+ */
+void FrameScheduler::endFrame()
+{
+  ++mFrames;
+  if (mPeriod == 0)
+  {
+    return;
+  }
+  unsigned long used = micros() - mFrameStart;
+  if (used > mPeriod)
+  {
+    ++mMissed;
+    return;  //Late already; start the next one straight away.
+  }
+  unsigned long left = mPeriod - used;
+  delay(left / 1000);
+  delayMicroseconds(left % 1000);
+}
+
+/*Like LitePixel::waitLatch(idle): small pieces of work, and a plain wait once
+ * they run out.  A frame that was on time when the wait began isn't missed
+ * because the last idle() ran past the end of it.
+ */
+template <class Idle>
+void FrameScheduler::endFrame(Idle& idle)
+{
+  if (mPeriod && micros() - mFrameStart < mPeriod)
+  {
+    while (micros() - mFrameStart < mPeriod)
+    {
+      if (!idle.idle())
+      {
+        endFrame();
+        return;
+      }
+    }
+    ++mFrames;
+    return;
+  }
+  endFrame();
+}
+
+#endif //SCHEDULER_H
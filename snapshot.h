@@ -0,0 +1,231 @@
+/*snapshot.h
+ * Warm start.  The rain takes minutes to grow from a blank strip into
+ * something worth looking at, so after a power blip we'd rather carry on from
+ * where we were.  With USE_SNAPSHOT defined (see CONFIG.h) loop() saves the
+ * frame and the rain's state to EEPROM every SNAPSHOT_SECONDS, and setup()
+ * puts them back before the first frame.
+ *
+ * SPI RAM would be quicker to write but it forgets everything when the power
+ * goes, which is the one time we need it, so it's EEPROM.  That's 1K on an
+ * Uno, less than 388 pixels take, so each channel is saved as a nibble: 16
+ * levels, each within 8 of what it was, and a channel that was lit stays lit
+ * (the faintest round up to 17 rather than down to 0).  The rain walks away
+ * from the rounding within a few frames.  Any pixels that still don't fit
+ * aren't saved, and come back as copies of the ones that were.
+ *
+ * An EEPROM write takes 3.3ms and we won't wait on one, so a save goes a byte
+ * a frame, only when the last write is done: 10 or 20 seconds at 30 fps,
+ * reading a pixel off the pix array as its bytes come up.
+ *
+ * A save that's cut short leaves new bytes in front of old ones, with the old
+ * save's check at the end, which then doesn't match, so it isn't restored.
+ * The check is a Fletcher-16, so about one torn save in 65,000 gets past it,
+ * and what that puts back is still a frame of rain.  Nothing is written twice
+ * in a save, so an EEPROM byte wears at most once a save.
+ */
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <EEPROM.h>
+#include "CONFIG.h"
+#include "rain.h"
+
+/*The snapshot, from SNAPSHOT_ADDR:
+ *   'D' 'R'         magic
+ *   version  byte   VERSION
+ *   pixels   uint16 how many were saved, little-endian
+ *   hue      byte   Rain::hueMask()
+ *   seed     uint32 Rain::randState(), little-endian
+ *   pixels   nibbles, red, green, blue of pixel 0, then pixel 1 and so on,
+ *                   high nibble first
+ *   check    2 bytes, Fletcher-16 of every byte from version on: the sum of
+ *                   the bytes mod 255, then the sum of those sums mod 255
+ */
+class Snapshot
+{
+public:
+  static const byte VERSION = 2;
+  static const int HEADER = 10;  //Bytes before the pixels.
+  //As many pixels as fit, up to all of them.
+  static const int PIX = (long)CONFIG::NUM_PIX * 3 <= (SNAPSHOT_EEPROM_BYTES - HEADER - 2) * 2L
+                         ? CONFIG::NUM_PIX : (SNAPSHOT_EEPROM_BYTES - HEADER - 2) * 2L / 3;
+
+  Snapshot();
+  bool restore(Rain& rain);  //From setup(), before rain.setup().  False if there was none.
+  void poll(Rain& rain);     //Once a frame: a byte of the save, when one's due.
+  unsigned int saved() { return mSaved; }  //Saves finished since power up.
+private:
+  static int sumAddr(int pix) { return HEADER + (3 * pix + 1) / 2; }  //The check's first byte.
+  static void check(byte& sum1, byte& sum2, byte b);
+  inline byte at(int addr) { return EEPROM.read(SNAPSHOT_ADDR + addr); }
+  byte saveByte(int addr);
+  byte nibble(int k);
+
+  int mStep;           //The byte of the save we're on, -1 when idle.
+  unsigned long mLast; //millis() when the last save finished.
+  byte mHue;           //The rain's state when this save started.
+  uint32_t mSeed;
+  byte mSum1;          //The check so far.
+  byte mSum2;
+  int mPixId;          //The pixel in mPix, -1 for none.
+  COLOR mPix;
+  unsigned int mSaved;
+};
+
+static_assert(Snapshot::PIX > 0, "SNAPSHOT_EEPROM_BYTES has no room for pixels");
+
+Snapshot::Snapshot() : mStep(-1), mLast(0), mPixId(-1), mSaved(0)
+{
+}
+
+//One more byte into the check.  Mod 255 without a division.
+void Snapshot::check(byte& sum1, byte& sum2, byte b)
+{
+  unsigned int s = sum1 + b;
+  sum1 = s >= 255 ? s - 255 : s;
+  s = sum2 + sum1;
+  sum2 = s >= 255 ? s - 255 : s;
+}
+
+/*Bulk: a span at a time into the pix array, SPAN_PIX pixels to a burst.  The
+ * pixels go to the back frame, and swap() puts them on show, so a double
+ * buffered build gets them in front where the rain reads.
+ */
+bool Snapshot::restore(Rain& rain)
+{
+  if (at(0) != 'D' || at(1) != 'R' || at(2) != VERSION)
+  {
+    return false;
+  }
+  int count = at(3) | (at(4) << 8);
+  if (count < 1 || sumAddr(count) + 1 >= SNAPSHOT_EEPROM_BYTES)
+  {
+    return false;
+  }
+  byte sum1 = 0;
+  byte sum2 = 0;
+  for (int a=2; a<sumAddr(count); ++a)
+  {
+    check(sum1, sum2, at(a));
+  }
+  if (sum1 != at(sumAddr(count)) || sum2 != at(sumAddr(count) + 1))
+  {
+    return false;  //Torn or garbled.
+  }
+
+  COLOR span[CONFIG::SPAN_PIX];
+  int src = 0;  //Saved pixel this one comes from.  They repeat if we saved fewer.
+  for (int first=0; first<CONFIG::NUM_PIX; first+=CONFIG::SPAN_PIX)
+  {
+    int n = CONFIG::NUM_PIX - first;
+    if (n > CONFIG::SPAN_PIX)
+    {
+      n = CONFIG::SPAN_PIX;
+    }
+    for (int p=0; p<n; ++p)
+    {
+      span[p].l = 0;
+      for (byte c=0; c<3; ++c)
+      {
+        int k = 3 * src + c;
+        byte b = at(HEADER + k / 2);
+        span[p].c[c] = ((k & 1) ? b & 0x0F : b >> 4) * 17;
+      }
+      if (++src == count)
+      {
+        src = 0;
+      }
+    }
+    CONFIG::pix.setSpan(first, n, span);
+  }
+  CONFIG::pix.swap();
+  uint32_t seed = 0;
+  for (byte i=0; i<4; ++i)
+  {
+    seed |= (uint32_t)at(6 + i) << (8 * i);
+  }
+  rain.resume(at(5), seed);
+  return true;
+}
+
+/*One byte per call at most, and only when the EEPROM has finished the last
+ * one.  update() leaves a byte alone if it hasn't changed, which saves the
+ * wear (the magic is only ever written once) but not the wait for the next
+ * frame.
+ */
+void Snapshot::poll(Rain& rain)
+{
+  if (mStep < 0)
+  {
+    if (millis() - mLast < SNAPSHOT_SECONDS * 1000UL)
+    {
+      return;
+    }
+    mHue = rain.hueMask();
+    mSeed = rain.randState();
+    mSum1 = 0;
+    mSum2 = 0;
+    mPixId = -1;
+    mStep = 0;
+  }
+  if (!eeprom_is_ready())
+  {
+    return;
+  }
+  EEPROM.update(SNAPSHOT_ADDR + mStep, saveByte(mStep));
+  if (++mStep > sumAddr(PIX) + 1)
+  {
+    mStep = -1;
+    mLast = millis();
+    ++mSaved;
+  }
+}
+
+//Byte addr of the snapshot, from 0 up, one at a time and in order.
+byte Snapshot::saveByte(int addr)
+{
+  byte b;
+  switch (addr)
+  {
+    case 0: return 'D';
+    case 1: return 'R';
+    case 2: b = VERSION; break;
+    case 3: b = PIX & 0xFF; break;
+    case 4: b = PIX >> 8; break;
+    case 5: b = mHue; break;
+    case 6: case 7: case 8: case 9:
+      b = mSeed >> (8 * (addr - 6));
+      break;
+    default:
+      if (addr == sumAddr(PIX))
+      {
+        return mSum1;
+      }
+      if (addr == sumAddr(PIX) + 1)
+      {
+        return mSum2;
+      }
+      int k = 2 * (addr - HEADER);
+      b = (nibble(k) << 4) | (k + 1 < 3 * PIX ? nibble(k + 1) : 0);
+  }
+  check(mSum1, mSum2, b);
+  return b;
+}
+
+/*Nibble k is channel k % 3 of pixel k / 3, rounded to the nearest of 0, 17,
+ * 34 ... 255 but never down to 0.
+ */
+byte Snapshot::nibble(int k)
+{
+  int id = k / 3;
+  if (id != mPixId)
+  {
+    CONFIG::pix.getSpan(id, 1, &mPix);
+    mPixId = id;
+  }
+  byte v = mPix.c[k % 3];
+  byte n = (v + 8) / 17;
+  return (v && !n) ? 1 : n;
+}
+
+#endif //SNAPSHOT_H
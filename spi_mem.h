@@ -5,47 +5,311 @@
 #define SPI_MEM_H
 
 #include "CONFIG.h"
+#include "telemetry.h"
+#ifdef HOST_SIM
+#include <Sim.h>  //Host build: the chips are simulated, and fitted to match SPI_BANKS.
+#endif
 
-/*This module uses the SPI bus to attach a 23K256 (32K) RAM module where we can 
- * store larger arrays than the arduino's 2K memory allows.
+/*This module uses the SPI bus to attach a 23K256 (32K) RAM module, or several,
+ * or bigger ones, where we can store larger arrays than the arduino's 2K
+ * memory allows.
  */
 
  /*HARDWARE CONNECTIONS
   * The following pairs are the pins which are connected between the arduino and 
   * 23K256 chip  { [Arduino, 23K256], [10,1], [11,5], [12,2], [13,6] }
   * The 23K256 pins 7 and 8 connect to +5V, pin 4 to Ground and pin 3 is unused.
+  * More chips share pins 11, 12 and 13 and each gets its own chip select (its
+  * pin 1) from SPI_BANK_PINS: 10 for the first, then 9, 8 and 7.  A 23LC1024
+  * has the same pinout.
   */
 
-#define MEMSIZE 32767
+/*One address space across SPI_BANKS chips (see CONFIG.h), bank 0 first.  An
+ * address is bank * SPI_BANK_BYTES plus the address on that chip.  Parts of
+ * 64K or less take a 16 bit address, bigger ones like the 23LC1024 take 24.
+ */
+#define MEMSIZE ((long)SPI_BANKS * SPI_BANK_BYTES)  //Bytes across every bank.
 /*spiMem should be a singleton
- * spiMem is going to be our super-crude memory manager.  We'll refine it in future
- * iterations but for now let's just make it as simple as possible. 
- * Let's say byte 0 on our chip is reserved (largely because we'd like to model 
- * normal c++ memory usage as much as possible so we'll overload the meaning of
- * addr on our chip with the concept of NULL pointer. 
+ * spiMem is our memory manager for the chips.  It hands out blocks of chip
+ * memory the way malloc hands out arduino memory, except what you get back is
+ * a chip address (an SpiAddr) rather than a pointer, because the chips aren't
+ * in our address space.  Let's say page 0 on our first chip is reserved (largely
+ * because we'd like to model normal c++ memory usage as much as possible so
+ * we'll overload the meaning of addr 0 on our chip with the concept of NULL
+ * pointer.
+ * It also does the talking to the chips, so nothing else needs to know which
+ * chip an address is on.  (The SpiRAM library only knows one chip and 16 bit
+ * addresses; we still use its opcodes.)
  */
-
-byte clock = 0;
-//SpiRAM SpiRam(0, CONFIG::PIN_SPIRAM);
-SpiRAM SpiRam(0, 10);
 namespace spiMem
 {
-  int next_addr=1;  /*For now pretend we never release memory*/
-  
-  int* spi_alloc(int num_bytes)
+#if SPI_BANKS * SPI_BANK_BYTES >= 65536L
+  typedef uint32_t SpiAddr;  //A byte address across the banks, and one past the end.
+#else
+  typedef uint16_t SpiAddr;  //Under 64K, every address and one past the end fit in 2 bytes.
+#endif
+  const SpiAddr SPI_NULL = 0;
+  const byte ADDR_BYTES = SPI_BANK_BYTES > 65536L ? 3 : 2;  //Address bytes after a command.
+  const byte BANK_PINS[] = SPI_BANK_PINS;  //Chip select per bank.
+  static_assert(SPI_BANKS >= 1 && SPI_BANKS <= sizeof(BANK_PINS), "SPI_BANKS needs a chip select pin each in SPI_BANK_PINS");
+
+  /*Blocks start on a page and take whole pages.  The chip's page mode wraps
+   * at 32 byte boundaries, and a buffer that starts on one never has a burst
+   * straddle two buffers' pages.  Banks are whole pages, so no page straddles
+   * two chips; blocks may.
+   */
+  const uint16_t PAGE_BYTES = 32;
+
+  /*The block table lives in arduino memory, a few bytes a block, sorted by
+   * address.  We only ever have a handful of buffers (frame, back buffer,
+   * flags, a snapshot or two) so a small fixed table is plenty.
+   */
+  const byte MAX_BLOCKS = 8;
+  SpiAddr block_addr[MAX_BLOCKS];
+  SpiAddr block_size[MAX_BLOCKS];
+  byte num_blocks = 0;
+  SpiAddr high_water = PAGE_BYTES;  //Highest address ever handed out, plus one.
+  bool begun = false;
+
+  /*Chip selects up, SPI on, and every chip in sequential (stream) mode, which
+   * is the only mode we use: reads and writes of any length, and across page
+   * boundaries.  Setting it once here saves a mode command on every burst.
+   * Runs before the first allocation, which is before anything else can talk
+   * to the chips.
+   */
+  void spi_begin()
+  {
+    begun = true;
+    SPI.begin();
+    SPI.setClockDivider(SPI_CLOCK_DIV4);
+    for (byte b=0; b<SPI_BANKS; ++b)
+    {
+#ifdef HOST_SIM
+      Sim::spiRamChip(BANK_PINS[b], SPI_BANK_BYTES, ADDR_BYTES);  //Solder one on.
+#endif
+      pinMode(BANK_PINS[b], OUTPUT);
+      digitalWrite(BANK_PINS[b], LOW);
+      SPI.transfer(WRSR);
+      SPI.transfer(STREAM_MODE);
+      digitalWrite(BANK_PINS[b], HIGH);
+    }
+  }
+
+  /*First fit: walk the blocks in address order and take the first gap big
+   * enough.  Freed blocks leave gaps that later allocations reuse.  Returns
+   * SPI_NULL if there's no room or no free slot in the table.
+   */
+  SpiAddr spi_alloc(SpiAddr num_bytes)
   {
-    int* ret=NULL;
-    int new_addr = next_addr + num_bytes;
-    if ( (new_addr) < MEMSIZE) 
+    if (!begun)
     {
-      ret = malloc(sizeof(int));
-      if (ret != NULL )
+      spi_begin();
+    }
+    if (num_blocks == MAX_BLOCKS || num_bytes == 0)
+    {
+      return SPI_NULL;
+    }
+    long size = ((long)num_bytes + PAGE_BYTES - 1) / PAGE_BYTES * PAGE_BYTES;  //Round up to pages.
+    long addr = PAGE_BYTES;  //Page 0 is NULL.
+    byte i = 0;
+    for (; i<num_blocks; ++i)
+    {
+      if ((long)block_addr[i] - addr >= size)
       {
-        *ret = next_addr;
-        next_addr = new_addr;
+        break;  //Fits in the gap before block i.
       }
+      addr = (long)block_addr[i] + block_size[i];
+    }
+    if (MEMSIZE - addr < size)
+    {
+      return SPI_NULL;  //Only reached when no gap fit, so the tail was the last hope.
+    }
+    for (byte j=num_blocks; j>i; --j)  //Make room to keep the table sorted.
+    {
+      block_addr[j] = block_addr[j-1];
+      block_size[j] = block_size[j-1];
+    }
+    block_addr[i] = addr;
+    block_size[i] = size;
+    ++num_blocks;
+    if (addr + size > (long)high_water)
+    {
+      high_water = addr + size;
+    }
+    return addr;
+  }
+
+  //Give a block back.  Freeing SPI_NULL does nothing, like free(NULL).
+  void spi_free(SpiAddr addr)
+  {
+    for (byte i=0; i<num_blocks; ++i)
+    {
+      if (block_addr[i] == addr)
+      {
+        --num_blocks;
+        for (byte j=i; j<num_blocks; ++j)
+        {
+          block_addr[j] = block_addr[j+1];
+          block_size[j] = block_size[j+1];
+        }
+        return;
+      }
+    }
+  }
+
+  //Bytes handed out right now, counting the rounding up to pages.
+  SpiAddr spi_in_use()
+  {
+    SpiAddr total = 0;
+    for (byte i=0; i<num_blocks; ++i)
+    {
+      total += block_size[i];
+    }
+    return total;
+  }
+
+  /*One past the highest address ever handed out, page 0 included: how far up
+   * the chips first fit has reached.  Gaps left by freed blocks count, so it
+   * can be more than spi_in_use() ever was.
+   */
+  SpiAddr spi_high_water()
+  {
+    return high_water;
+  }
+
+  /*Select the chip addr is on and send it cmd and where on the chip.  Returns
+   * how many bytes there are from there to the end of that chip.  Bank sizes
+   * are powers of 2, so the / and % are shifts and masks.
+   */
+  SpiAddr spi_select(byte cmd, SpiAddr addr)
+  {
+    byte bank = addr / SPI_BANK_BYTES;
+    SpiAddr on = addr % SPI_BANK_BYTES;
+    digitalWrite(BANK_PINS[bank], LOW);
+    SPI.transfer(cmd);
+    if (ADDR_BYTES == 3)
+    {
+      SPI.transfer((byte)((uint32_t)on >> 16));
+    }
+    SPI.transfer((byte)(on >> 8));
+    SPI.transfer((byte)on);
+    TELE_ADD(Telemetry::SPI_BYTES, 1 + ADDR_BYTES);
+    return SPI_BANK_BYTES - on;
+  }
+
+  inline void spi_deselect(SpiAddr addr)
+  {
+    digitalWrite(BANK_PINS[addr / SPI_BANK_BYTES], HIGH);
+  }
+
+  /*Burst reads and writes: a command, an address and then the bytes, one
+   * transaction per chip they touch.
+   */
+  void spi_read(SpiAddr addr, byte* buf, uint16_t len)
+  {
+    while (len > 0)
+    {
+      SpiAddr room = spi_select(READ, addr);
+      uint16_t n = room < len ? room : len;
+      for (uint16_t i=0; i<n; ++i)
+      {
+        *buf++ = SPI.transfer(0xFF);
+      }
+      spi_deselect(addr);
+      TELE_ADD(Telemetry::SPI_BYTES, n);
+      addr += n;
+      len -= n;
+    }
+  }
+
+  void spi_write(SpiAddr addr, const byte* buf, uint16_t len)
+  {
+    while (len > 0)
+    {
+      SpiAddr room = spi_select(WRITE, addr);
+      uint16_t n = room < len ? room : len;
+      for (uint16_t i=0; i<n; ++i)
+      {
+        SPI.transfer(*buf++);
+      }
+      spi_deselect(addr);
+      TELE_ADD(Telemetry::SPI_BYTES, n);
+      addr += n;
+      len -= n;
+    }
+  }
+
+  /*A stream read hands bytes back one at a time from a single chip-select
+   * transaction, as many as you like, for as long as you like between them.
+   * The display uses it to send a whole frame straight from the chips:
+   *   streamBegin(address); ... streamNext() per byte ...; streamEnd();
+   * Nothing else may use the bus in between.
+   *
+   * When the stream runs off the end of one chip it carries on at the start of
+   * the next.  That costs one gap of a chip select and a command (about 5 bytes
+   * of SPI, a few us) between two bytes, well inside the strip's latch time,
+   * and nothing at all with one bank.
+   */
+  SpiAddr stream_at;    //Address of the byte on its way in.  Only kept with banks.
+  SpiAddr stream_left;  //Bytes left on this chip from stream_at.
+  byte stream_pin;      //Chip select of the chip we're on.
+
+  inline void streamBegin(SpiAddr address)
+  {
+    stream_at = address;
+    stream_pin = BANK_PINS[address / SPI_BANK_BYTES];
+    stream_left = spi_select(READ, address);
+#ifndef HOST_SIM
+    SPDR = 0xFF;  //Start clocking in the first byte.
+#endif
+  }
+
+  //On to the next chip, the first one again after the last.
+  void streamCross()
+  {
+    digitalWrite(stream_pin, HIGH);
+    stream_at %= MEMSIZE;
+    stream_pin = BANK_PINS[stream_at / SPI_BANK_BYTES];
+    stream_left = spi_select(READ, stream_at);
+  }
+
+  /*On the board the next byte is already on its way in while the caller sends
+   * this one to the strip: 8 SPI clocks take 2us, a byte on the strip takes
+   * 12us, so by the time we're back SPIF is long set and we never wait.
+   */
+  inline byte streamNext()
+  {
+#ifdef HOST_SIM
+    byte b = SPI.transfer(0xFF);
+#else
+    while (!(SPSR & _BV(SPIF)))
+    {
+    }
+    byte b = SPDR;
+#endif
+    if (SPI_BANKS > 1)
+    {
+      ++stream_at;
+      if (--stream_left == 0)
+      {
+        streamCross();
+      }
+    }
+#ifndef HOST_SIM
+    SPDR = 0xFF;  //And the one after.
+#endif
+    return b;
+  }
+
+  inline void streamEnd()
+  {
+#ifndef HOST_SIM
+    while (!(SPSR & _BV(SPIF)))  //Let the byte we started finish, or the next
+    {                            //transfer() collides with it.
     }
-    return ret;
+    (void)SPDR;
+#endif
+    digitalWrite(stream_pin, HIGH);
   }
 };
-#endif SPI_MEM_H
+#endif //SPI_MEM_H
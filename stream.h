@@ -0,0 +1,76 @@
+/*stream.h
+ * Render and display in one pass.
+ *
+ * The usual frame is two sweeps of the strip: the effect walks every pixel
+ * into the pix array, then display_pix reads every one back out to send it.
+ * stream_pix asks the effect for each pixel just before it goes on the wire,
+ * so there is no second sweep and an effect that works pixels out from
+ * scratch (a gradient, a clock) needs no pix array at all.
+ *
+ * An effect for stream_pix has four calls:
+ *   beginFrame()   Before interrupts go off.  Anything slow goes here.
+ *   idle()         While the last frame latches.  See LitePixel::waitLatch.
+ *   pixel(id)      The COLOR for pixel id, asked for in order 0 to NUM_PIX-1.
+ *   endFrame()     After the latch.  Anything slow goes here too.
+ * and one constant:
+ *   PIXEL_US       The longest pixel() takes, in us.
+ *
+ * pixel() runs in the gap between two pixels on the wire with interrupts off.
+ * If that gap reaches the strip's latch time the strip shows what it has and
+ * the rest of the frame starts again from the first LED, so stream_pix won't
+ * build an effect whose PIXEL_US isn't under LATCH_US (see CONFIG.h).  The
+ * rain's pixel() reads or writes a span of EMIT_SPAN_PIX pixels, 38us and more
+ * over SPI (see CONFIG::SPAN_READ_US), so stream mode wants a strip that holds
+ * out for the datasheet's latch.  The host bench reports the worst gap it
+ * sees.
+ * The gap is all the effect's, so stream_pix trades away interrupts: they stay
+ * off for the whole frame, 13ms at 388 LEDs, and millis() and Serial lose
+ * what comes in meanwhile.  The display proper lets them in every
+ * EMIT_GROUP_PIX pixels instead.
+ */
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "CONFIG.h"
+#include "litepixel.h"
+#include "telemetry.h"
+
+#if LED_LANES > 1
+#error "stream_pix drives a single lane; turn off STREAM_RENDER or set LED_LANES to 1"
+#endif
+
+/*The rain's pixel() hands each changed pixel to capture.h, and its encode and
+ * ring push would land in the gap on the wire too, which PIXEL_US doesn't
+ * count.
+ */
+#ifdef USE_CAPTURE
+#error "USE_CAPTURE would work in stream_pix's gap between pixels; turn off STREAM_RENDER or USE_CAPTURE"
+#endif
+
+/*Each pixel is stepped as it's sent, so each has to be sent exactly once, in
+ * order: no PIX_MAP (see pixmap.h) beyond one pixel per LED.
+ */
+static_assert(CONFIG::PIX_SEGMENTS == 1 && CONFIG::PIX_MAP[0].first == 0 && CONFIG::PIX_MAP[0].scale == 1 &&
+              !CONFIG::PIX_MAP[0].reverse, "stream_pix can't show a pixel twice; turn off STREAM_RENDER or PIX_MAP");
+
+template <class Effect>
+void stream_pix(LitePixel& lite, Effect& fx)
+{
+  static_assert(Effect::PIXEL_US < LATCH_US, "pixel() could hold the wire low past the latch; lower EMIT_SPAN_PIX");
+  byte wire[3];
+  TELE_BEGIN(Telemetry::DISPLAY);  //The walk is in here too: there's no telling them apart.
+  fx.beginFrame();
+  lite.waitLatch(fx);
+  cli();
+  for (int id=0;id<CONFIG::NUM_PIX;++id)
+  {
+    colorToWire(wire, fx.pixel(id));  //Worked out while the last pixel latches in.
+    lite.sendBytes(wire, 3);
+  }
+  sei();
+  lite.show();
+  fx.endFrame();
+  TELE_END(Telemetry::DISPLAY);
+}
+
+#endif //STREAM_H
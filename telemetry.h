@@ -0,0 +1,236 @@
+/*telemetry.h
+ * Where do the cycles go?  With USE_TELEMETRY defined (see CONFIG.h) the hot
+ * paths time themselves and count what they move, and every TELEMETRY_FRAMES
+ * frames loop() sends a summary of them over Serial as one small binary
+ * record.  host/teledump turns the records back into numbers.
+ *
+ * The hooks are macros, so without USE_TELEMETRY they are nothing at all.  Not
+ * an empty call the optimizer may or may not throw away, and not even their
+ * arguments: no code, and the build comes out exactly as it was without them.
+ *
+ *   TELE_BEGIN(Telemetry::WALK);  ...  TELE_END(Telemetry::WALK);
+ *   TELE_ADD(Telemetry::SPI_BYTES, n);
+ *   TELE_FRAME(sched.missed());   //Once a frame, from loop().
+ *
+ * The stages are the calls the frame's work is made of: the rain walk, the
+ * pix array's span reads (getSpan, and getWire for lanes) and writes
+ * (setSpan), its sendWire streams to the strip, and display_pix as a whole.
+ * The single pixel get() and set() are left out; nothing hot calls them.
+ *
+ * The timers are micros(), which on a 16MHz board moves in 4us steps and takes
+ * a few us itself.  A call as short as a span read mostly reads 0 or 4, so its
+ * total for a frame is more a count of ticks than a measurement, but over a
+ * record the mean comes out about right.  Looking costs something: the timed
+ * calls run slower with the timers in.
+ */
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#ifdef USE_TELEMETRY
+
+#ifndef TELEMETRY_FRAMES
+#define TELEMETRY_FRAMES 32
+#endif
+
+/*A record, little-endian, RECORD_BYTES long:
+ *   'T' 'L'          magic, to find the start of a record in the stream
+ *   version  byte    VERSION
+ *   seq      uint16  records made so far, sent or not.  A gap is a dropped one.
+ *   frames   byte    frames in this record
+ *   missed   uint16  frames the scheduler counted missed since the last
+ *                    record, up to the frame before this one's last
+ *   for each Stage, in order:
+ *     calls  uint16  calls a frame, mean
+ *     min    uint16  us a frame, all calls together: least,
+ *     max    uint16    most
+ *     mean   uint16    and mean
+ *   for each Counter, in order:
+ *     min, max, mean   uint16 each, per frame
+ *   sum      byte    of every byte after the magic, so a garbled record shows
+ * Anything bigger than 65535 is sent as 65535.
+ */
+class Telemetry
+{
+public:
+  enum Stage { WALK, GET, SET, STREAM, DISPLAY, STAGES };  //GET, SET: span calls.  STREAM: sendWire.
+  enum Counter { SPI_BYTES, CHANGED, COUNTERS };
+  static const byte VERSION = 3;
+  static const byte RECORD_BYTES = 8 + STAGES * 8 + COUNTERS * 6 + 1;
+
+  Telemetry();
+  inline void begin(byte stage);
+  inline void end(byte stage);
+  inline void add(byte counter, unsigned long n);
+  void frame(unsigned long missed);  //Fold this frame into the record; send it when it's full.
+  unsigned int dropped() { return mDropped; }  //Records Serial had no room for.
+private:
+  void send();
+  void put16(byte*& at, unsigned long v);
+
+  unsigned long mStart[STAGES];     //micros() at begin().
+  unsigned long mFrameUs[STAGES];   //This frame so far.
+  unsigned int mFrameCalls[STAGES];
+  unsigned long mFrameCount[COUNTERS];
+
+  //The record so far.
+  unsigned long mCalls[STAGES];
+  unsigned long mUsMin[STAGES];
+  unsigned long mUsMax[STAGES];
+  unsigned long mUsSum[STAGES];
+  unsigned long mCountMin[COUNTERS];
+  unsigned long mCountMax[COUNTERS];
+  unsigned long mCountSum[COUNTERS];
+  byte mFrames;
+  unsigned long mMissed;      //FrameScheduler::missed() at the last frame(),
+  unsigned long mMissedSent;  //and at the last record.
+  unsigned int mSeq;
+  unsigned int mDropped;
+};
+
+/*The whole record has to fit in Serial's transmit buffer (64 bytes on an Uno)
+ * so that writing it never waits.
+ */
+static_assert(Telemetry::RECORD_BYTES < 64, "telemetry record must fit Serial's transmit buffer");
+
+Telemetry::Telemetry() : mFrames(0), mMissed(0), mMissedSent(0), mSeq(0), mDropped(0)
+{
+  for (byte s=0; s<STAGES; ++s)
+  {
+    mFrameUs[s] = 0;
+    mFrameCalls[s] = 0;
+  }
+  for (byte c=0; c<COUNTERS; ++c)
+  {
+    mFrameCount[c] = 0;
+  }
+}
+
+inline void Telemetry::begin(byte stage)
+{
+  mStart[stage] = micros();
+}
+
+inline void Telemetry::end(byte stage)
+{
+  mFrameUs[stage] += micros() - mStart[stage];
+  ++mFrameCalls[stage];
+}
+
+inline void Telemetry::add(byte counter, unsigned long n)
+{
+  mFrameCount[counter] += n;
+}
+
+/*missed is the scheduler's running count.  loop() calls us before the
+ * scheduler has seen this frame out, so it's up to the frame before.
+ */
+void Telemetry::frame(unsigned long missed)
+{
+  bool first = mFrames == 0;
+  mMissed = missed;
+  for (byte s=0; s<STAGES; ++s)
+  {
+    unsigned long us = mFrameUs[s];
+    mCalls[s] = (first ? 0 : mCalls[s]) + mFrameCalls[s];
+    mUsSum[s] = (first ? 0 : mUsSum[s]) + us;
+    if (first || us < mUsMin[s])
+    {
+      mUsMin[s] = us;
+    }
+    if (first || us > mUsMax[s])
+    {
+      mUsMax[s] = us;
+    }
+    mFrameUs[s] = 0;
+    mFrameCalls[s] = 0;
+  }
+  for (byte c=0; c<COUNTERS; ++c)
+  {
+    unsigned long n = mFrameCount[c];
+    mCountSum[c] = (first ? 0 : mCountSum[c]) + n;
+    if (first || n < mCountMin[c])
+    {
+      mCountMin[c] = n;
+    }
+    if (first || n > mCountMax[c])
+    {
+      mCountMax[c] = n;
+    }
+    mFrameCount[c] = 0;
+  }
+  if (++mFrames >= TELEMETRY_FRAMES)
+  {
+    send();
+    mFrames = 0;
+  }
+}
+
+void Telemetry::put16(byte*& at, unsigned long v)
+{
+  if (v > 0xFFFF)
+  {
+    v = 0xFFFF;
+  }
+  *at++ = v & 0xFF;
+  *at++ = v >> 8;
+}
+
+/*Only if it all fits in the transmit buffer right now.  If it doesn't, the
+ * last record hasn't gone yet (the baud rate is too slow for TELEMETRY_FRAMES)
+ * and this one is dropped rather than have loop() wait on the serial port.
+ */
+void Telemetry::send()
+{
+  byte rec[RECORD_BYTES];
+  byte* at = rec;
+  *at++ = 'T';
+  *at++ = 'L';
+  *at++ = VERSION;
+  put16(at, mSeq++);
+  *at++ = mFrames;
+  put16(at, mMissed - mMissedSent);
+  mMissedSent = mMissed;
+  for (byte s=0; s<STAGES; ++s)
+  {
+    put16(at, mCalls[s] / mFrames);
+    put16(at, mUsMin[s]);
+    put16(at, mUsMax[s]);
+    put16(at, mUsSum[s] / mFrames);
+  }
+  for (byte c=0; c<COUNTERS; ++c)
+  {
+    put16(at, mCountMin[c]);
+    put16(at, mCountMax[c]);
+    put16(at, mCountSum[c] / mFrames);
+  }
+  byte sum = 0;
+  for (byte* p=rec + 2; p<at; ++p)
+  {
+    sum += *p;
+  }
+  *at++ = sum;
+  if (Serial.availableForWrite() < RECORD_BYTES)
+  {
+    ++mDropped;
+    return;
+  }
+  Serial.write(rec, RECORD_BYTES);
+}
+
+Telemetry tele;
+
+#define TELE_BEGIN(stage) tele.begin(stage)
+#define TELE_END(stage) tele.end(stage)
+#define TELE_ADD(counter, n) tele.add(counter, n)
+#define TELE_FRAME(missed) tele.frame(missed)
+
+#else  //USE_TELEMETRY
+
+#define TELE_BEGIN(stage)
+#define TELE_END(stage)
+#define TELE_ADD(counter, n)
+#define TELE_FRAME(missed)
+
+#endif //USE_TELEMETRY
+
+#endif //TELEMETRY_H